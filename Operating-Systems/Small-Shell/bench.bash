@@ -0,0 +1,117 @@
+#!/bin/bash
+#
+# Latency benchmark for smallsh
+#
+# Usage: ./bench.bash [-n commands] [-r runs] [-f json|csv] [path/to/smallsh]
+#
+# Drives smallsh with generated scripts and prints one record per metric:
+#   startup        time to start and exit on empty input
+#   builtin        per command dispatch of `true` (runs inside the shell)
+#   spawn          per command dispatch of /bin/true with posix_spawn
+#   fork           the same with SMALLSH_LAUNCH=fork
+#   redirect       /bin/true > file, spawn path
+#   redirect_bi    echo > file, builtin path
+#   background     /bin/true & followed by wait, per job
+#   reap           how late mass job completion is noticed, per job
+#
+# Every value is microseconds, the median of the runs.
+
+commands=2000
+runs=5
+format=json
+shell=./smallsh
+
+while getopts "n:r:f:" opt; do
+    case $opt in
+        n) commands=$OPTARG ;;
+        r) runs=$OPTARG ;;
+        f) format=$OPTARG ;;
+        *) echo "usage: $0 [-n commands] [-r runs] [-f json|csv] [smallsh]" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -gt 0 ]; then
+    shell=$1
+fi
+
+if [ ! -x "$shell" ]; then
+    gcc -O2 -o "$shell" "$(dirname "$0")/smallsh.c" || exit 1
+fi
+shell=$(realpath "$shell")
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# Writes `count` copies of a line to a script
+make_script() {
+    local file=$1 line=$2 count=$3
+    for ((i = 0; i < count; i++)); do
+        echo "$line"
+    done > "$file"
+}
+
+# Median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { if (NR % 2) print v[(NR + 1) / 2]; else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# Microseconds per command from the shell's end of script report
+per_command() {
+    local script=$1
+    shift
+    for ((r = 0; r < runs; r++)); do
+        (cd "$work" && env "$@" "$shell" "$script" 2>&1 >/dev/null) |
+            sed -n 's/.*(\([0-9.]*\) us\/command).*/\1/p'
+    done | median
+}
+
+if [ "$format" = "csv" ]; then
+    echo "metric,us,commands,runs"
+fi
+
+emit() {
+    if [ "$format" = "csv" ]; then
+        echo "$1,$2,$3,$runs"
+    else
+        echo "{\"metric\": \"$1\", \"us\": $2, \"commands\": $3, \"runs\": $runs}"
+    fi
+}
+
+# Startup, wall time around the whole process
+for ((r = 0; r < runs; r++)); do
+    start=$(date +%s%N)
+    for ((i = 0; i < 50; i++)); do
+        "$shell" < /dev/null 2>/dev/null
+    done
+    end=$(date +%s%N)
+    echo $(( (end - start) / 50000 ))
+done | median | { read -r us; emit startup "$us" 1; }
+
+make_script "$work/builtin.sh" "true" "$commands"
+emit builtin "$(per_command "$work/builtin.sh")" "$commands"
+
+make_script "$work/external.sh" "/bin/true" "$commands"
+emit spawn "$(per_command "$work/external.sh")" "$commands"
+emit fork "$(per_command "$work/external.sh" SMALLSH_LAUNCH=fork)" "$commands"
+
+make_script "$work/redirect.sh" "/bin/true > out.txt" "$commands"
+emit redirect "$(per_command "$work/redirect.sh")" "$commands"
+
+make_script "$work/redirect_bi.sh" "echo hi > out.txt" "$commands"
+emit redirect_bi "$(per_command "$work/redirect_bi.sh")" "$commands"
+
+make_script "$work/background.sh" "/bin/true &" "$commands"
+echo "wait" >> "$work/background.sh"
+emit background "$(per_command "$work/background.sh")" "$commands"
+
+# Reaping, every job sleeps the same time and the log records when
+# the shell saw it exit. Anything past the sleep is reaping delay
+jobs=$((commands / 10 > 0 ? commands / 10 : 1))
+make_script "$work/reap.sh" "sleep 0.2 &" "$jobs"
+echo "wait" >> "$work/reap.sh"
+for ((r = 0; r < runs; r++)); do
+    rm -f "$work/reap.log"
+    (cd "$work" && SMALLSH_STATLOG="$work/reap.log" "$shell" reap.sh >/dev/null 2>&1)
+    awk -F '\t' '$8 ~ /^sleep/ { s += $2; n++ }
+        END { if (n) printf "%.1f\n", (s / n - 0.2) * 1e6 }' "$work/reap.log"
+done | median | { read -r us; emit reap "$us" "$jobs"; }
@@ -1,5 +1,7 @@
 // Name: Gabriel Valdez
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,31 +9,519 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <spawn.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <termios.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <sys/syscall.h>
 
 #define BUFF_SIZE 2049
-#define MAX_ARGS 512
+#define PUMP_CHUNK 65536
+#define PATH_BUCKETS 64
+#define READ_BLOCK 65536
+#define PID_BUCKETS 64
+#define REAP_BATCH 64
+#define JOBS_START 16
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define IOPRIO_CLASS_SHIFT 13
+#define GLOB_MARK '\001'
+#define REDIR_READ 0
+#define REDIR_WRITE 1
+#define REDIR_APPEND 2
+#define REDIR_DUP 3
+#define REDIR_DATA 4
+
+// Job Structure
+// One per pipeline, in its own process group when interactive
+struct Job {
+	int id;
+	pid_t pgid;
+	pid_t last;
+	int alive;
+	int stopped;
+	int bg;
+	int status;
+	char* cmd;
+	int timed;
+	struct timespec started;
+	struct rusage ru;
+};
 
 // Process Structure 
-// Linked list
+// Chained per bucket of the pid table
 struct Process {
     pid_t val;
+    struct Job* job;
     struct Process* next;
 };
 
+// Command path cache entry
+// Chained per bucket
+struct PathEntry {
+	char* name;
+	char* path;
+	int hits;
+	struct PathEntry* next;
+};
+
+// Directory listing cache entry
+// Chained per bucket, valid while the directory's mtime holds
+struct DirListing {
+	char* path;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtime;
+	char** names;
+	size_t count;
+	struct DirListing* next;
+};
+
+// Input reader
+// Reads blocks and hands out lines from one reusable buffer
+struct Reader {
+	int fd;
+	int wake_fd;
+	char* buf;
+	size_t len;
+	size_t pos;
+	char* line;
+	size_t line_cap;
+};
+
+// Lexer
+// Token text and argv live in buffers reused by every command
+struct Lexer {
+	char* text;
+	size_t text_len;
+	size_t text_cap;
+	char** argv;
+	char* ops;
+	size_t argc;
+	size_t argv_cap;
+};
+
+// Scheduling controls for a job
+// Applied by the shell to each process it starts
+struct Sched {
+	int active;
+	int has_cpus;
+	cpu_set_t cpus;
+	int has_nice;
+	int nice;
+	int ioprio;
+	int cg_fd;
+};
+
 // Shell Strcuture
 struct Shell {
 	char** args;
 	int fg_mode;
 	int recent;
 	int current;
-	struct Process* bg_pids;
-	struct Process* bg_head;
+	struct Process** bg_pids;
+	int bg_buckets;
 	int bg_count;
+	int sig_pipe[2];
+	struct Job** jobs;
+	int jobs_cap;
+	int tty_fd;
+	pid_t shell_pgid;
+	pid_t fg_pgid;
+	int time_next;
+	int force_fork;
+	struct Sched sched_next;
+	struct Sched sched_bg;
+	struct Sched* sched_cur;
+	FILE* stat_log;
+	int pipe_size;
+	struct PathEntry* path_cache[PATH_BUCKETS];
+	struct DirListing* dir_cache[PATH_BUCKETS];
+	char* path_env;
+	struct Reader in;
+	struct Lexer lex;
+	struct Stage* stages;
+	int stages_cap;
+	struct Redir* redirs;
+	int redirs_cap;
+	int batch;
+	const char* script;
+	struct timespec start;
+	long commands;
+};
+
+// Redirection of one descriptor
+// DUP copies src, DATA reads a memfd made by the shell
+struct Redir {
+	int fd;
+	int kind;
+	int src;
+	char* target;
+};
+
+// Pipeline stage
+// argv points into the shell's args array
+// redirs point into the shell's redirs array, applied in order
+struct Stage {
+	char** argv;
+	const char* path;
+	struct Redir* redirs;
+	int nredirs;
 };
 
 // Global shell
 struct Shell* smallsh = NULL;
 
+int sh_status(int status);
+int exit_code(int status);
+char* read_line(struct Reader* r);
+
+
+
+/******************************************************************************
+ * Name: path_hash
+ * Description:
+ * 	Hashes a command name into a path cache bucket (FNV-1a)
+ * Parameters:
+ * 	- name: Command name
+******************************************************************************/
+unsigned int path_hash(const char* name) {
+	unsigned int h = 2166136261u;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619u;
+	}
+	return h & (PATH_BUCKETS - 1);
+}
+
+
+/******************************************************************************
+ * Name: clear_path_cache
+ * Description:
+ * 	Forgets remembered command locations
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - relative_only: Non zero to only drop paths that depend on the cwd
+******************************************************************************/
+void clear_path_cache(struct Shell* s, int relative_only) {
+	int i;
+	for (i = 0; i < PATH_BUCKETS; i++) {
+		struct PathEntry** prev = &s->path_cache[i];
+		while (*prev != NULL) {
+			struct PathEntry* e = *prev;
+			if (relative_only && e->path[0] == '/') {
+				prev = &e->next;
+				continue;
+			}
+			*prev = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Name: search_path
+ * Description:
+ * 	Walks PATH for an executable regular file named name
+ * 	Returns a newly allocated path or NULL
+ * Parameters:
+ * 	- name: Command name
+******************************************************************************/
+char* search_path(const char* name) {
+	const char* dirs = getenv("PATH");
+	if (dirs == NULL) {
+		dirs = "/usr/bin:/bin";
+	}
+
+	size_t name_len = strlen(name);
+	while (1) {
+		const char* end = strchrnul(dirs, ':');
+		size_t dir_len = end - dirs;
+
+		// Empty entry means the current directory
+		char* cand = (char*)malloc(dir_len + name_len + 3);
+		if (cand == NULL) {
+			return NULL;
+		}
+		if (dir_len == 0) {
+			strcpy(cand, ".");
+			dir_len = 1;
+		} else {
+			memcpy(cand, dirs, dir_len);
+		}
+		cand[dir_len] = '/';
+		memcpy(cand + dir_len + 1, name, name_len + 1);
+
+		struct stat sb;
+		if (stat(cand, &sb) == 0 && S_ISREG(sb.st_mode) && access(cand, X_OK) == 0) {
+			return cand;
+		}
+		free(cand);
+
+		if (*end == '\0') {
+			return NULL;
+		}
+		dirs = end + 1;
+	}
+}
+
+
+/******************************************************************************
+ * Name: resolve_command
+ * Description:
+ * 	Looks a command up in the path cache, searching PATH on a miss
+ * 	The cache is dropped when PATH changes and an entry is dropped
+ * 	when its binary is no longer executable
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - name: Command name
+******************************************************************************/
+const char* resolve_command(struct Shell* s, const char* name) {
+	// Paths are used as is
+	if (strchr(name, '/') != NULL) {
+		return name;
+	}
+
+	// PATH changed since the cache was filled
+	const char* env = getenv("PATH");
+	if (env == NULL) {
+		env = "";
+	}
+	if (s->path_env == NULL || strcmp(s->path_env, env) != 0) {
+		clear_path_cache(s, 0);
+		free(s->path_env);
+		s->path_env = strdup(env);
+	}
+
+	unsigned int b = path_hash(name);
+	struct PathEntry** prev = &s->path_cache[b];
+	while (*prev != NULL) {
+		struct PathEntry* e = *prev;
+		if (strcmp(e->name, name) == 0) {
+			// One access check instead of a failed exec per PATH entry
+			if (access(e->path, X_OK) == 0) {
+				e->hits++;
+				return e->path;
+			}
+			*prev = e->next;
+			free(e->name);
+			free(e->path);
+			free(e);
+			break;
+		}
+		prev = &e->next;
+	}
+
+	char* path = search_path(name);
+	if (path == NULL) {
+		return NULL;
+	}
+
+	struct PathEntry* e = (struct PathEntry*)malloc(sizeof(struct PathEntry));
+	if (e == NULL) {
+		free(path);
+		return NULL;
+	}
+	e->name = strdup(name);
+	e->path = path;
+	e->hits = 1;
+	e->next = s->path_cache[b];
+	s->path_cache[b] = e;
+	return path;
+}
+
+
+/******************************************************************************
+ * Name: sh_hash
+ * Description:
+ * 	Lists remembered command locations
+ * 	hash -r forgets them all, hash name... looks the names up
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_hash(struct Shell* s, char** args) {
+	int i;
+
+	if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+		clear_path_cache(s, 0);
+		return 0;
+	}
+
+	// Add the named commands
+	if (args[1] != NULL) {
+		for (i = 1; args[i] != NULL; i++) {
+			if (resolve_command(s, args[i]) == NULL) {
+				fprintf(stdout, "hash: %s: not found\n", args[i]);
+			}
+		}
+		fflush(stdout);
+		return 0;
+	}
+
+	int empty = 1;
+	for (i = 0; i < PATH_BUCKETS; i++) {
+		struct PathEntry* e;
+		for (e = s->path_cache[i]; e != NULL; e = e->next) {
+			if (empty) {
+				fprintf(stdout, "hits\tcommand\n");
+				empty = 0;
+			}
+			fprintf(stdout, "%4d\t%s\n", e->hits, e->path);
+		}
+	}
+	if (empty) {
+		fprintf(stdout, "hash: hash table empty\n");
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: clear_dir_cache
+ * Description:
+ * 	Forgets cached directory listings
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - relative_only: Non zero to only drop listings that depend on the cwd
+******************************************************************************/
+void clear_dir_cache(struct Shell* s, int relative_only) {
+	int i;
+	size_t k;
+	for (i = 0; i < PATH_BUCKETS; i++) {
+		struct DirListing** prev = &s->dir_cache[i];
+		while (*prev != NULL) {
+			struct DirListing* d = *prev;
+			if (relative_only && d->path[0] == '/') {
+				prev = &d->next;
+				continue;
+			}
+			*prev = d->next;
+			for (k = 0; k < d->count; k++) {
+				free(d->names[k]);
+			}
+			free(d->names);
+			free(d->path);
+			free(d);
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Name: compare_names
+ * Description:
+ * 	qsort comparison for arrays of strings
+ * Parameters:
+ * 	- a: Pointer to the first string
+ *  - b: Pointer to the second string
+******************************************************************************/
+int compare_names(const void* a, const void* b) {
+	return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+
+/******************************************************************************
+ * Name: read_dir
+ * Description:
+ * 	Returns the sorted names in a directory
+ * 	A cached listing is reused while the directory's mtime is unchanged
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - path: Directory to list
+******************************************************************************/
+struct DirListing* read_dir(struct Shell* s, const char* path) {
+	struct stat sb;
+	if (stat(path, &sb) == -1 || !S_ISDIR(sb.st_mode)) {
+		return NULL;
+	}
+
+	unsigned int b = path_hash(path);
+	struct DirListing* d;
+	for (d = s->dir_cache[b]; d != NULL; d = d->next) {
+		if (strcmp(d->path, path) == 0) {
+			break;
+		}
+	}
+	if (d != NULL && d->ino == sb.st_ino && d->dev == sb.st_dev &&
+		d->mtime.tv_sec == sb.st_mtim.tv_sec && d->mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+		return d;
+	}
+
+	DIR* dir = opendir(path);
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	// New entry, or drop the stale names of an old one
+	if (d == NULL) {
+		d = (struct DirListing*)calloc(1, sizeof(struct DirListing));
+		if (d == NULL || (d->path = strdup(path)) == NULL) {
+			free(d);
+			closedir(dir);
+			return NULL;
+		}
+		d->next = s->dir_cache[b];
+		s->dir_cache[b] = d;
+	}
+	size_t k, cap = d->count;
+	for (k = 0; k < d->count; k++) {
+		free(d->names[k]);
+	}
+	d->count = 0;
+
+	struct dirent* ent;
+	while ((ent = readdir(dir)) != NULL) {
+		if (d->count == cap) {
+			cap = cap ? cap * 2 : 32;
+			char** names = (char**)realloc(d->names, cap * sizeof(char*));
+			if (names == NULL) {
+				break;
+			}
+			d->names = names;
+		}
+		if ((d->names[d->count] = strdup(ent->d_name)) == NULL) {
+			break;
+		}
+		d->count++;
+	}
+	closedir(dir);
+
+	qsort(d->names, d->count, sizeof(char*), compare_names);
+	d->ino = sb.st_ino;
+	d->dev = sb.st_dev;
+	d->mtime = sb.st_mtim;
+	return d;
+}
+
+
+/******************************************************************************
+ * Name: clear_sched
+ * Description:
+ * 	Drops every scheduling control and closes the cgroup
+ * Parameters:
+ * 	- sc: Pointer to the controls
+******************************************************************************/
+void clear_sched(struct Sched* sc) {
+	if (sc->cg_fd != -1) {
+		close(sc->cg_fd);
+	}
+	memset(sc, 0, sizeof(*sc));
+	sc->cg_fd = -1;
+}
 
 
 /******************************************************************************
@@ -48,27 +538,58 @@ void free_shell(struct Shell* s){
 		return;
 	}
 
-	// Iterate args while there is memory allocated
-	if (s->args != NULL) {
-        int i = 0;
-		while(s->args[i] != NULL) {
-			// Free data
-			free(s->args[i]);
-			s->args[i] = NULL;
-			i++;
+	// Args live in the lexer
+	s->args = NULL;
+
+	// Free input and lexer buffers
+	free(s->in.buf);
+	free(s->in.line);
+	free(s->lex.text);
+	free(s->lex.argv);
+	free(s->lex.ops);
+	free(s->stages);
+	free(s->redirs);
+	if (s->in.fd > STDIN_FILENO) {
+		close(s->in.fd);
+	}
+
+	// Free background process table
+	int b;
+	for (b = 0; b < s->bg_buckets; b++) {
+		struct Process* temp = s->bg_pids[b];
+		while (temp != NULL) {
+			struct Process* prev = temp;
+			temp = temp->next;
+			free(prev);
 		}
-		// Free the args array itself
-        free(s->args);
-		s->args = NULL;
-    }
+	}
+	free(s->bg_pids);
 
-	// Free background process list
-    struct Process* temp = s->bg_pids;
-    while (temp != NULL) {
-        struct Process* prev = temp;
-        temp = temp->next;
-        free(prev);
-    }
+	// Free job table
+	int j;
+	for (j = 0; j < s->jobs_cap; j++) {
+		if (s->jobs[j] != NULL) {
+			free(s->jobs[j]->cmd);
+			free(s->jobs[j]);
+		}
+	}
+	free(s->jobs);
+	if (s->stat_log != NULL) {
+		fclose(s->stat_log);
+	}
+	if (s->sig_pipe[0] != -1) {
+		close(s->sig_pipe[0]);
+		close(s->sig_pipe[1]);
+	}
+
+	// Close cgroups
+	clear_sched(&s->sched_next);
+	clear_sched(&s->sched_bg);
+
+	// Free command path cache
+	clear_path_cache(s, 0);
+	free(s->path_env);
+	clear_dir_cache(s, 0);
 
 	// Free the Shell structure itself
     free(s);
@@ -79,428 +600,3394 @@ void free_shell(struct Shell* s){
 /******************************************************************************
  * Name: build_pids
  * Description:
- * 	Build's pid list
+ * 	Build's pid and job tables
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+void build_pids(struct Shell* s){
+	// Error handling
+	if(s == NULL){
+		return;
+	}
+	s->bg_buckets = PID_BUCKETS;
+	s->bg_pids = (struct Process**)calloc(s->bg_buckets, sizeof(struct Process*));
+	s->bg_count = 0;
+	s->jobs_cap = JOBS_START;
+	s->jobs = (struct Job**)calloc(s->jobs_cap, sizeof(struct Job*));
+}
+
+
+/******************************************************************************
+ * Name: add_process
+ * Description:
+ * 	Adds a job's pid to the pid table
+ * 	Doubles the buckets when the table gets full so lookups stay O(1)
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - pid: Process id
+ *  - job: Job the process belongs to
+******************************************************************************/
+int add_process(struct Shell* s, pid_t pid, struct Job* job) {
+	// Rehash into twice the buckets
+	if (s->bg_count >= s->bg_buckets) {
+		int size = s->bg_buckets * 2, b;
+		struct Process** table = (struct Process**)calloc(size, sizeof(struct Process*));
+		if (table != NULL) {
+			for (b = 0; b < s->bg_buckets; b++) {
+				struct Process* p = s->bg_pids[b];
+				while (p != NULL) {
+					struct Process* next = p->next;
+					p->next = table[p->val & (size - 1)];
+					table[p->val & (size - 1)] = p;
+					p = next;
+				}
+			}
+			free(s->bg_pids);
+			s->bg_pids = table;
+			s->bg_buckets = size;
+		}
+	}
+
+	// Allocate memory for processes
+	struct Process* p = (struct Process*)malloc(sizeof(struct Process));
+	if (p == NULL) {
+		return 0;
+	}
+	// Store process variables
+	p->val = pid;
+	p->job = job;
+	job->alive++;
+	// Insert at head of its bucket
+	p->next = s->bg_pids[pid & (s->bg_buckets - 1)];
+	s->bg_pids[pid & (s->bg_buckets - 1)] = p;
+	s->bg_count++;
+	return 1;
+}
+
+
+/******************************************************************************
+ * Name: find_process
+ * Description:
+ * 	Looks a pid up in the pid table
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - pid: Process id
+******************************************************************************/
+struct Process* find_process(struct Shell* s, pid_t pid) {
+	struct Process* p = s->bg_pids[pid & (s->bg_buckets - 1)];
+	while (p != NULL && p->val != pid) {
+		p = p->next;
+	}
+	return p;
+}
+
+
+/******************************************************************************
+ * Name: remove_process
+ * Description:
+ * 	Removes a pid from the pid table
+ * 	Returns the job it belonged to or NULL
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - pid: Process id
+******************************************************************************/
+struct Job* remove_process(struct Shell* s, pid_t pid) {
+	struct Process** prev = &s->bg_pids[pid & (s->bg_buckets - 1)];
+	while (*prev != NULL) {
+		struct Process* curr = *prev;
+		if (curr->val == pid) {
+			struct Job* job = curr->job;
+			*prev = curr->next;
+			free(curr);
+			s->bg_count--;
+			job->alive--;
+			return job;
+		}
+		prev = &curr->next;
+	}
+	return NULL;
+}
+
+
+/******************************************************************************
+ * Name: new_job
+ * Description:
+ * 	Creates a job in the lowest free job number
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - cmd: Command text shown by jobs, owned by the job
+ *  - bg_flag: Non zero for background jobs
+******************************************************************************/
+struct Job* new_job(struct Shell* s, char* cmd, int bg_flag) {
+	int i;
+	for (i = 0; i < s->jobs_cap && s->jobs[i] != NULL; i++);
+
+	// Table full, double it
+	if (i == s->jobs_cap) {
+		struct Job** tmp = (struct Job**)realloc(s->jobs, 2 * s->jobs_cap * sizeof(struct Job*));
+		if (tmp == NULL) {
+			return NULL;
+		}
+		memset(tmp + s->jobs_cap, 0, s->jobs_cap * sizeof(struct Job*));
+		s->jobs = tmp;
+		s->jobs_cap *= 2;
+	}
+
+	struct Job* job = (struct Job*)calloc(1, sizeof(struct Job));
+	if (job == NULL) {
+		return NULL;
+	}
+	job->id = i + 1;
+	job->bg = bg_flag;
+	job->cmd = cmd;
+	job->timed = s->time_next;
+	clock_gettime(CLOCK_MONOTONIC, &job->started);
+	s->jobs[i] = job;
+	return job;
+}
+
+
+/******************************************************************************
+ * Name: free_job
+ * Description:
+ * 	Drops a finished job from the job table
  * Parameters:
  * 	- s: Pointer to shell structure
+ *  - job: Pointer to the job
+******************************************************************************/
+void free_job(struct Shell* s, struct Job* job) {
+	s->jobs[job->id - 1] = NULL;
+	free(job->cmd);
+	free(job);
+}
+
+
+/******************************************************************************
+ * Name: find_job
+ * Description:
+ * 	Finds a job from %n, a pid, or the most recent job for NULL
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - spec: Job spec string
+******************************************************************************/
+struct Job* find_job(struct Shell* s, const char* spec) {
+	int i;
+
+	// Most recent job
+	if (spec == NULL || strcmp(spec, "%") == 0 || strcmp(spec, "%+") == 0) {
+		for (i = s->jobs_cap - 1; i >= 0; i--) {
+			if (s->jobs[i] != NULL) {
+				return s->jobs[i];
+			}
+		}
+		return NULL;
+	}
+
+	if (spec[0] == '%') {
+		i = atoi(spec + 1);
+		return (i >= 1 && i <= s->jobs_cap) ? s->jobs[i - 1] : NULL;
+	}
+
+	struct Process* p = find_process(s, (pid_t)atoi(spec));
+	return p ? p->job : NULL;
+}
+
+
+/******************************************************************************
+ * Name: add_rusage
+ * Description:
+ * 	Adds one process's resource usage into a job total
+ * 	CPU times and context switches add up, max RSS is the peak
+ * Parameters:
+ * 	- total: Job total
+ *  - ru: Usage of one process
+******************************************************************************/
+void add_rusage(struct rusage* total, const struct rusage* ru) {
+	timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+	timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+	if (ru->ru_maxrss > total->ru_maxrss) {
+		total->ru_maxrss = ru->ru_maxrss;
+	}
+	total->ru_nvcsw += ru->ru_nvcsw;
+	total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+
+/******************************************************************************
+ * Name: report_stats
+ * Description:
+ * 	Prints a finished command's resource usage to stderr when it was
+ * 	run with time, and appends it to the stat log when one is open
+ * 	Log lines are tab separated:
+ * 	status wall user sys maxrss_kb vcsw ivcsw command
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - cmd: Command text
+ *  - code: Exit status, 128 + signal for killed commands
+ *  - wall: Wall time in seconds
+ *  - ru: Resource usage
+ *  - timed: Non zero if run with time
+******************************************************************************/
+void report_stats(struct Shell* s, const char* cmd, int code, double wall, const struct rusage* ru, int timed) {
+	double user = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+	double sys = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+
+	if (timed) {
+		fprintf(stderr, "\nreal\t%.3fs\nuser\t%.3fs\nsys\t%.3fs\nmaxrss\t%ld KB\nctxsw\t%ld voluntary, %ld involuntary\n",
+			wall, user, sys, ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw);
+	}
+	if (s->stat_log != NULL) {
+		fprintf(s->stat_log, "%d\t%.6f\t%.6f\t%.6f\t%ld\t%ld\t%ld\t%s\n",
+			code, wall, user, sys, ru->ru_maxrss, ru->ru_nvcsw, ru->ru_nivcsw, cmd ? cmd : "");
+		fflush(s->stat_log);
+	}
+}
+
+
+/******************************************************************************
+ * Name: update_process
+ * Description:
+ * 	Records a wait status for one of the shell's children
+ * 	Prints the completion message for background processes
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - pid: Process id
+ *  - stat: Status from wait4
+ *  - ru: Resource usage from wait4, or NULL
+******************************************************************************/
+void update_process(struct Shell* s, pid_t pid, int stat, struct rusage* ru) {
+	struct Process* p = find_process(s, pid);
+	if (p == NULL) {
+		return;
+	}
+	struct Job* job = p->job;
+
+	// ^Z or SIGSTOP, the job waits for fg or bg
+	if (WIFSTOPPED(stat)) {
+		job->stopped = 1;
+		return;
+	}
+	if (WIFCONTINUED(stat)) {
+		return;
+	}
+
+	if (pid == job->last) {
+		job->status = stat;
+	}
+	if (ru != NULL) {
+		add_rusage(&job->ru, ru);
+	}
+	if (job->bg) {
+		if (WIFEXITED(stat)) {
+			printf("Background process %d is done: exit value %d\n", pid, WEXITSTATUS(stat));
+		} else if (WIFSIGNALED(stat)) {
+			printf("Background process %d is done: terminated by signal %d\n", pid, WTERMSIG(stat));
+		}
+	}
+
+	remove_process(s, pid);
+	if (job->alive == 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double wall = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+		int code = exit_code(job->status);
+		report_stats(s, job->cmd, code, wall, &job->ru, job->timed);
+		if (job->bg) {
+			free_job(s, job);
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Name: reap_children
+ * Description:
+ * 	Collects finished background processes from the main loop
+ * 	zombie_handler only pokes the self pipe, the waitpid calls and
+ * 	messages happen here in batches of REAP_BATCH outside the handler
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+void reap_children(struct Shell* s) {
+	char drain[64];
+	pid_t pids[REAP_BATCH];
+	int stats[REAP_BATCH];
+	struct rusage rus[REAP_BATCH];
+
+	// Empty the self pipe before waiting so no wakeup is lost
+	while (read(s->sig_pipe[0], drain, sizeof(drain)) > 0);
+
+	int n;
+	do {
+		n = 0;
+		while (n < REAP_BATCH && (pids[n] = wait4(-1, &stats[n], WNOHANG | WUNTRACED, &rus[n])) > 0) {
+			n++;
+		}
+
+		int i;
+		for (i = 0; i < n; i++) {
+			update_process(s, pids[i], stats[i], &rus[i]);
+		}
+		fflush(stdout);
+	} while (n == REAP_BATCH);
+}
+
+
+/******************************************************************************
+ * Name: signal_job
+ * Description:
+ * 	Sends a signal to every process of a job
+ * 	Script mode jobs share the shell's process group, so each
+ * 	process is signalled on its own
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - job: Pointer to the job
+ *  - sig: Signal to send
+******************************************************************************/
+void signal_job(struct Shell* s, struct Job* job, int sig) {
+	int b;
+
+	if (!s->batch) {
+		kill(-job->pgid, sig);
+		return;
+	}
+	for (b = 0; b < s->bg_buckets; b++) {
+		struct Process* p;
+		for (p = s->bg_pids[b]; p != NULL; p = p->next) {
+			if (p->job == job) {
+				kill(p->val, sig);
+			}
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Name: wait_for_job
+ * Description:
+ * 	Waits for a job in the foreground
+ * 	Hands it the terminal and takes the terminal back when the job
+ * 	finishes or stops. Stopped jobs stay in the job table
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - job: Pointer to the job
+******************************************************************************/
+int wait_for_job(struct Shell* s, struct Job* job) {
+	job->bg = 0;
+	s->fg_pgid = job->pgid;
+	if (s->tty_fd != -1) {
+		tcsetpgrp(s->tty_fd, job->pgid);
+	}
+
+	while (job->alive > 0 && !job->stopped) {
+		int stat;
+		struct rusage ru;
+		pid_t pid = wait4(s->batch ? -1 : -job->pgid, &stat, WUNTRACED, &ru);
+		if (pid == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		update_process(s, pid, stat, &ru);
+	}
+
+	// Take the terminal back
+	s->fg_pgid = 0;
+	if (s->tty_fd != -1) {
+		tcsetpgrp(s->tty_fd, s->shell_pgid);
+	}
+
+	if (job->stopped) {
+		job->bg = 1;
+		printf("\n[%d] Stopped\t%s\n", job->id, job->cmd);
+		fflush(stdout);
+		return 0;
+	}
+
+	// Store exit stat of the last stage
+	s->recent = job->status;
+	free_job(s, job);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: sh_jobs
+ * Description:
+ * 	Lists the jobs
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+int sh_jobs(struct Shell* s) {
+	reap_children(s);
+
+	int i;
+	for (i = 0; i < s->jobs_cap; i++) {
+		struct Job* job = s->jobs[i];
+		if (job != NULL) {
+			printf("[%d] %d %s\t%s%s\n", job->id, job->pgid, job->stopped ? "Stopped" : "Running", job->cmd, job->bg && !job->stopped ? " &" : "");
+		}
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: sh_fg
+ * Description:
+ * 	Continues a job in the foreground and waits for it
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_fg(struct Shell* s, char** args) {
+	struct Job* job = find_job(s, args[1]);
+	if (job == NULL) {
+		fprintf(stdout, "fg: no such job\n");
+		fflush(stdout);
+		return 0;
+	}
+
+	printf("%s\n", job->cmd);
+	fflush(stdout);
+
+	// Hold SIGCHLD until the job is waited
+	sigset_t chld, old;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old);
+
+	job->stopped = 0;
+	if (s->tty_fd != -1) {
+		tcsetpgrp(s->tty_fd, job->pgid);
+	}
+	signal_job(s, job, SIGCONT);
+	wait_for_job(s, job);
+
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: sh_bg
+ * Description:
+ * 	Continues a stopped job in the background
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_bg(struct Shell* s, char** args) {
+	struct Job* job = find_job(s, args[1]);
+	if (job == NULL) {
+		fprintf(stdout, "bg: no such job\n");
+		fflush(stdout);
+		return 0;
+	}
+
+	job->stopped = 0;
+	job->bg = 1;
+	signal_job(s, job, SIGCONT);
+	printf("[%d] %s &\n", job->id, job->cmd);
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: running_jobs
+ * Description:
+ * 	Counts jobs that are not stopped
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+int running_jobs(struct Shell* s) {
+	int i, n = 0;
+	for (i = 0; i < s->jobs_cap; i++) {
+		if (s->jobs[i] != NULL && !s->jobs[i]->stopped) {
+			n++;
+		}
+	}
+	return n;
+}
+
+
+/******************************************************************************
+ * Name: sh_wait
+ * Description:
+ * 	Blocks until the named jobs or pids finish, or all jobs
+ * 	Sets the status to that of the last one waited for
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_wait(struct Shell* s, char** args) {
+	int i = 1, stat;
+	struct rusage ru;
+
+	// No args, wait for every running job
+	if (args[1] == NULL) {
+		pid_t pid;
+		while (running_jobs(s) > 0 && (pid = wait4(-1, &stat, WUNTRACED, &ru)) != -1) {
+			update_process(s, pid, stat, &ru);
+		}
+		fflush(stdout);
+		s->recent = 0;
+		return 0;
+	}
+
+	for (i = 1; args[i] != NULL; i++) {
+		struct Job* job = find_job(s, args[i]);
+		if (job == NULL) {
+			fprintf(stdout, "wait: %s: no such job\n", args[i]);
+			fflush(stdout);
+			s->recent = W_EXITCODE(127, 0);
+			continue;
+		}
+
+		// A single pid or the whole process group
+		pid_t target = args[i][0] != '%' ? (pid_t)atoi(args[i]) : s->batch ? -1 : -job->pgid;
+		pid_t last = args[i][0] == '%' ? job->last : target;
+		pid_t pid;
+		while ((job = find_job(s, args[i])) != NULL && !job->stopped && (pid = wait4(target, &stat, WUNTRACED, &ru)) != -1) {
+			if (pid == last) {
+				s->recent = stat;
+			}
+			update_process(s, pid, stat, &ru);
+		}
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: build_shell
+ * Description:
+ * 	Initializes default shell struct
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+void build_shell(struct Shell* s) {
+	// Error handling
+	if (s == NULL){
+		return;
+	}
+
+	s->fg_mode = 0;
+	s->recent = 0;
+	s->current = 0;
+	s->args = NULL;
+	s->pipe_size = 0;
+	memset(s->path_cache, 0, sizeof(s->path_cache));
+	memset(s->dir_cache, 0, sizeof(s->dir_cache));
+	s->path_env = NULL;
+	memset(&s->in, 0, sizeof(s->in));
+	memset(&s->lex, 0, sizeof(s->lex));
+	s->stages = NULL;
+	s->stages_cap = 0;
+	s->redirs = NULL;
+	s->redirs_cap = 0;
+	s->in.wake_fd = -1;
+	s->sig_pipe[0] = s->sig_pipe[1] = -1;
+	s->tty_fd = -1;
+	s->shell_pgid = getpgrp();
+	s->fg_pgid = 0;
+	s->time_next = 0;
+	s->force_fork = 0;
+	memset(&s->sched_next, 0, sizeof(s->sched_next));
+	memset(&s->sched_bg, 0, sizeof(s->sched_bg));
+	s->sched_next.cg_fd = s->sched_bg.cg_fd = -1;
+	s->sched_cur = NULL;
+	s->stat_log = NULL;
+	s->batch = 0;
+	s->script = NULL;
+	s->commands = 0;
+	clock_gettime(CLOCK_MONOTONIC, &s->start);
+
+	build_pids(s);
+}
+
+
+/******************************************************************************
+ * Name: terminate_processes
+ * Description:
+ * 	Terminates all background processes 
+ * 	Frees the pid table entries
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+void terminate_processes(struct Shell* s) {
+	int j;
+
+	// Kill each job, stopped ones need a SIGCONT
+	for (j = 0; j < s->jobs_cap; j++) {
+		if (s->jobs[j] != NULL && s->jobs[j]->pgid > 0) {
+			signal_job(s, s->jobs[j], SIGTERM);
+			signal_job(s, s->jobs[j], SIGCONT);
+		}
+	}
+
+	int b;
+	for (b = 0; b < s->bg_buckets; b++) {
+		struct Process* temp = s->bg_pids[b];
+		struct Process* prev = NULL;
+
+		while (temp != NULL) {
+			// Wait for process to exit
+			waitpid(temp->val, NULL, 0); 
+
+			// Move to the next process before freeing current one
+			prev = temp;
+			temp = temp->next;
+			free(prev);
+		}
+		s->bg_pids[b] = NULL;
+	}
+
+	// Free the jobs
+	for (j = 0; j < s->jobs_cap; j++) {
+		if (s->jobs[j] != NULL) {
+			free_job(s, s->jobs[j]);
+		}
+	}
+
+    // Reset the table
+    s->bg_count = 0;
+}
+
+
+/******************************************************************************
+ * Name: report_timing
+ * Description:
+ * 	Prints how long a script took to stderr
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+void report_timing(struct Shell* s) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double secs = (end.tv_sec - s->start.tv_sec) + (end.tv_nsec - s->start.tv_nsec) / 1e9;
+	double per = s->commands ? secs * 1e6 / s->commands : 0.0;
+
+	fprintf(stderr, "smallsh: %s: %ld commands in %.6f s (%.1f us/command)\n",
+		s->script ? s->script : "stdin", s->commands, secs, per);
+}
+
+
+/******************************************************************************
+ * Name: sh_exit
+ * Description:
+ * 	Terminals all background process 
+ * 	Frees allocated memory 
+ * 	Exits shell
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+int sh_exit(struct Shell* s) {
+	if (s) {
+        terminate_processes(s);
+        if (s->batch) {
+            report_timing(s);
+        }
+        free_shell(s);
+    }
+
+	exit(0);
+}
+
+
+/******************************************************************************
+ * Name: sh_cd
+ * Description:
+ * 	Changes the current working directory
+ * 	If there is no argument, then it defaults to home directory
+ * Parameters:
+ * 	- args: Array of strings 
+******************************************************************************/
+int sh_cd(char** args){
+	// Check if there are arguements
+	// Else change to dir
+	if (args[1] == NULL) {
+        chdir(getenv("HOME"));
+    } else if (chdir(args[1]) != 0) {
+		fprintf(stdout, "CD error\n");
+		fflush(stdout);
+	}
+
+	// Relative PATH entries and listings now point somewhere else
+	clear_path_cache(smallsh, 1);
+	clear_dir_cache(smallsh, 1);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: redirect_file
+ * Description:
+ * 	 Handles one redirection of the current process
+ * 	 Returns 0 with errno set if it failed
+ * Parameters:
+ * 	- r: Pointer to the redirection
+******************************************************************************/
+int redirect_file(struct Redir* r) {
+	// Descriptor copies and here documents
+	if (r->kind == REDIR_DUP || r->kind == REDIR_DATA) {
+		return dup2(r->src, r->fd) != -1;
+	}
+
+	// Default file descriptor
+	int fd = -1;
+	if (r->kind == REDIR_READ) {
+		fd = open(r->target, O_RDONLY);
+	} else if (r->kind == REDIR_WRITE) {
+		fd = open(r->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	} else {
+		fd = open(r->target, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	}
+
+	// Failed
+	if (fd == -1) {
+		return 0;
+	}
+	if (fd != r->fd) {
+		dup2(fd, r->fd);
+		close(fd);
+	}
+	return 1;
+}
+
+
+/******************************************************************************
+ * Name: redir_error
+ * Description:
+ * 	 Prints why a redirection failed
+ * Parameters:
+ * 	- r: Pointer to the redirection
+ *  - err: errno of the failure
+******************************************************************************/
+void redir_error(struct Redir* r, int err) {
+	if (r->kind == REDIR_DUP) {
+		fprintf(stdout, "%d: %s\n", r->src, strerror(err));
+	} else {
+		fprintf(stdout, "%s: %s\n", r->target ? r->target : "here document", strerror(err));
+	}
+	fflush(stdout);
+}
+
+
+/******************************************************************************
+ * Name: exec_error
+ * Description:
+ * 	 Prints why a command could not be run
+ * Parameters:
+ * 	- name: Command name
+ *  - err: errno of the failed exec
+******************************************************************************/
+void exec_error(const char* name, int err) {
+	if (err == ENOENT) {
+		fprintf(stdout, "%s: command not found\n", name);
+	} else {
+		fprintf(stdout, "%s: %s\n", name, strerror(err));
+	}
+	fflush(stdout);
+}
+
+
+/******************************************************************************
+ * Name: sh_echo
+ * Description:
+ * 	Prints the arguments separated by spaces
+ * 	-n leaves off the newline
+ * Parameters:
+ * 	- args: Array of strings
+******************************************************************************/
+int sh_echo(char** args) {
+	int i = 1, newline = 1;
+	if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+		newline = 0;
+		i++;
+	}
+
+	int first = i;
+	for (; args[i] != NULL; i++) {
+		if (i > first) {
+			fputc(' ', stdout);
+		}
+		fputs(args[i], stdout);
+	}
+	if (newline) {
+		fputc('\n', stdout);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: sh_pwd
+ * Description:
+ * 	Prints the current working directory
+ * Parameters:
+ * 	- None
+******************************************************************************/
+int sh_pwd() {
+	char buf[PATH_MAX];
+	if (getcwd(buf, sizeof(buf)) == NULL) {
+		fprintf(stdout, "pwd error\n");
+		fflush(stdout);
+		return 1;
+	}
+	fprintf(stdout, "%s\n", buf);
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: print_escape
+ * Description:
+ * 	Prints one backslash escape from a printf format
+ * 	Returns the number of format characters used
+ * Parameters:
+ * 	- p: Pointer to the character after the backslash
+******************************************************************************/
+int print_escape(const char* p) {
+	switch (*p) {
+	case 'n': fputc('\n', stdout); return 1;
+	case 't': fputc('\t', stdout); return 1;
+	case 'r': fputc('\r', stdout); return 1;
+	case 'a': fputc('\a', stdout); return 1;
+	case 'b': fputc('\b', stdout); return 1;
+	case 'f': fputc('\f', stdout); return 1;
+	case 'v': fputc('\v', stdout); return 1;
+	case '\\': fputc('\\', stdout); return 1;
+	case '\0': fputc('\\', stdout); return 0;
+	}
+
+	// Octal \NNN
+	if (*p >= '0' && *p <= '7') {
+		int val = 0, n = 0;
+		while (n < 3 && p[n] >= '0' && p[n] <= '7') {
+			val = val * 8 + (p[n] - '0');
+			n++;
+		}
+		fputc(val, stdout);
+		return n;
+	}
+
+	fputc('\\', stdout);
+	fputc(*p, stdout);
+	return 1;
+}
+
+
+/******************************************************************************
+ * Name: sh_printf
+ * Description:
+ * 	Formats the arguments like printf(1)
+ * 	Supports %s %b %c %d %i %u %o %x %X %% with flags, width and
+ * 	precision, and reuses the format while arguments remain
+ * Parameters:
+ * 	- args: Array of strings
+******************************************************************************/
+int sh_printf(char** args) {
+	if (args[1] == NULL) {
+		fprintf(stdout, "usage: printf format [arguments]\n");
+		fflush(stdout);
+		return 2;
+	}
+
+	const char* fmt = args[1];
+	char** arg = &args[2];
+	int status = 0;
+
+	do {
+		int used = 0;
+		const char* p = fmt;
+		while (*p) {
+			if (*p == '\\') {
+				p += 1 + print_escape(p + 1);
+				continue;
+			}
+			if (*p != '%') {
+				fputc(*p++, stdout);
+				continue;
+			}
+			if (p[1] == '%') {
+				fputc('%', stdout);
+				p += 2;
+				continue;
+			}
+
+			// Copy the spec into a real printf format
+			char spec[32];
+			size_t n = 0;
+			spec[n++] = *p++;
+			while (*p && strchr("-+ #0123456789.", *p) && n < sizeof(spec) - 4) {
+				spec[n++] = *p++;
+			}
+			char conv = *p ? *p++ : 's';
+			const char* val = *arg ? *arg++ : "";
+			used = 1;
+
+			if (conv == 'd' || conv == 'i') {
+				spec[n++] = 'l';
+				spec[n++] = 'l';
+				spec[n++] = 'd';
+				spec[n] = '\0';
+				printf(spec, strtoll(val, NULL, 0));
+			} else if (conv == 'u' || conv == 'o' || conv == 'x' || conv == 'X') {
+				spec[n++] = 'l';
+				spec[n++] = 'l';
+				spec[n++] = conv;
+				spec[n] = '\0';
+				printf(spec, strtoull(val, NULL, 0));
+			} else if (conv == 'c') {
+				spec[n++] = 'c';
+				spec[n] = '\0';
+				printf(spec, val[0]);
+			} else if (conv == 'b') {
+				// String with escapes expanded
+				while (*val) {
+					if (*val == '\\') {
+						val += 1 + print_escape(val + 1);
+					} else {
+						fputc(*val++, stdout);
+					}
+				}
+			} else if (conv == 's') {
+				spec[n++] = 's';
+				spec[n] = '\0';
+				printf(spec, val);
+			} else {
+				fprintf(stdout, "printf: %%%c: invalid directive\n", conv);
+				status = 1;
+			}
+		}
+		if (!used) {
+			break;
+		}
+	} while (*arg != NULL);
+
+	fflush(stdout);
+	return status;
+}
+
+
+/******************************************************************************
+ * Name: test_unary
+ * Description:
+ * 	Evaluates a unary test expression like -f file
+ * 	Returns 1 for true, 0 for false, -1 for an unknown operator
+ * Parameters:
+ * 	- op: Operator
+ *  - arg: Operand
+******************************************************************************/
+int test_unary(const char* op, const char* arg) {
+	struct stat sb;
+
+	if (strcmp(op, "-n") == 0) {
+		return arg[0] != '\0';
+	} else if (strcmp(op, "-z") == 0) {
+		return arg[0] == '\0';
+	} else if (strcmp(op, "-r") == 0) {
+		return access(arg, R_OK) == 0;
+	} else if (strcmp(op, "-w") == 0) {
+		return access(arg, W_OK) == 0;
+	} else if (strcmp(op, "-x") == 0) {
+		return access(arg, X_OK) == 0;
+	} else if (strcmp(op, "-L") == 0 || strcmp(op, "-h") == 0) {
+		return lstat(arg, &sb) == 0 && S_ISLNK(sb.st_mode);
+	}
+
+	if (op[0] != '-' || op[1] == '\0' || op[2] != '\0' || !strchr("efdsp", op[1])) {
+		return -1;
+	}
+	if (stat(arg, &sb) != 0) {
+		return 0;
+	}
+	switch (op[1]) {
+	case 'f': return S_ISREG(sb.st_mode);
+	case 'd': return S_ISDIR(sb.st_mode);
+	case 's': return sb.st_size > 0;
+	case 'p': return S_ISFIFO(sb.st_mode);
+	}
+	return 1;
+}
+
+
+/******************************************************************************
+ * Name: test_binary
+ * Description:
+ * 	Evaluates a binary test expression like a -lt b
+ * 	Returns 1 for true, 0 for false, -1 for an unknown operator
+ * Parameters:
+ * 	- a: Left operand
+ *  - op: Operator
+ *  - b: Right operand
+******************************************************************************/
+int test_binary(const char* a, const char* op, const char* b) {
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) {
+		return strcmp(a, b) == 0;
+	} else if (strcmp(op, "!=") == 0) {
+		return strcmp(a, b) != 0;
+	}
+
+	long long x = strtoll(a, NULL, 10), y = strtoll(b, NULL, 10);
+	if (strcmp(op, "-eq") == 0) {
+		return x == y;
+	} else if (strcmp(op, "-ne") == 0) {
+		return x != y;
+	} else if (strcmp(op, "-lt") == 0) {
+		return x < y;
+	} else if (strcmp(op, "-le") == 0) {
+		return x <= y;
+	} else if (strcmp(op, "-gt") == 0) {
+		return x > y;
+	} else if (strcmp(op, "-ge") == 0) {
+		return x >= y;
+	}
+	return -1;
+}
+
+
+/******************************************************************************
+ * Name: sh_test
+ * Description:
+ * 	Evaluates a test or [ expression
+ * 	Handles ! and the zero to three argument forms of test(1)
+ * 	Returns 0 for true, 1 for false, 2 for errors
+ * Parameters:
+ * 	- args: Array of strings
+******************************************************************************/
+int sh_test(char** args) {
+	int argc = 0;
+	while (args[argc] != NULL) {
+		argc++;
+	}
+
+	// [ needs its closing ]
+	if (strcmp(args[0], "[") == 0) {
+		if (strcmp(args[argc - 1], "]") != 0) {
+			fprintf(stdout, "[: missing ]\n");
+			fflush(stdout);
+			return 2;
+		}
+		argc--;
+	}
+
+	char** a = &args[1];
+	int n = argc - 1, negate = 0, res;
+	// A leading ! negates the rest, unless ! is the left operand of
+	// a binary expression like ! = x
+	while (n > 0 && strcmp(a[0], "!") == 0 && !(n == 3 && test_binary(a[0], a[1], a[2]) != -1)) {
+		negate = !negate;
+		a++;
+		n--;
+	}
+
+	if (n == 0) {
+		res = 0;
+	} else if (n == 1) {
+		res = a[0][0] != '\0';
+	} else if (n == 2) {
+		res = test_unary(a[0], a[1]);
+	} else if (n == 3) {
+		res = test_binary(a[0], a[1], a[2]);
+	} else {
+		res = -1;
+	}
+
+	if (res == -1) {
+		fprintf(stdout, "%s: syntax error\n", args[0]);
+		fflush(stdout);
+		return 2;
+	}
+	return (negate ? !res : res) ? 0 : 1;
+}
+
+
+/******************************************************************************
+ * Name: run_utility
+ * Description:
+ * 	Runs echo, true, false, test, [, printf or pwd in process
+ * 	Returns the exit status or -1 if args is not one of them
+ * Parameters:
+ * 	- args: Array of strings
+******************************************************************************/
+int run_utility(char** args) {
+	if (strcmp(args[0], "echo") == 0) {
+		return sh_echo(args);
+	} else if (strcmp(args[0], "true") == 0) {
+		return 0;
+	} else if (strcmp(args[0], "false") == 0) {
+		return 1;
+	} else if (strcmp(args[0], "test") == 0 || strcmp(args[0], "[") == 0) {
+		return sh_test(args);
+	} else if (strcmp(args[0], "printf") == 0) {
+		return sh_printf(args);
+	} else if (strcmp(args[0], "pwd") == 0) {
+		return sh_pwd();
+	}
+	return -1;
+}
+
+
+/******************************************************************************
+ * Name: is_utility
+ * Description:
+ * 	Checks if a command is one of the in process utilities
+ * Parameters:
+ * 	- name: Command name
+******************************************************************************/
+int is_utility(const char* name) {
+	static const char* names[] = {"echo", "true", "false", "test", "[", "printf", "pwd", NULL};
+	int i;
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: is_shell_builtin
+ * Description:
+ * 	Checks if a command changes or reports on the shell itself
+ * 	These never run as a job, so time and sched have nothing to act on
+ * Parameters:
+ * 	- name: Command name
+******************************************************************************/
+int is_shell_builtin(const char* name) {
+	static const char* names[] = {"exit", "cd", "status", "pipesize", "hash", "jobs", "fg", "bg", "wait", "timelog", NULL};
+	int i;
+	for (i = 0; names[i] != NULL; i++) {
+		if (strcmp(name, names[i]) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: restore_fd
+ * Description:
+ * 	Puts back a descriptor saved before a redirection
+ * Parameters:
+ * 	- fd: Descriptor that was redirected
+ *  - saved: Saved copy, or -1 if fd was closed before
+******************************************************************************/
+void restore_fd(int fd, int saved) {
+	if (saved == -1) {
+		close(fd);
+		return;
+	}
+	dup2(saved, fd);
+	close(saved);
+}
+
+
+/******************************************************************************
+ * Name: restore_redirs
+ * Description:
+ * 	Puts back the descriptors saved by shell_redirs, last first
+ * Parameters:
+ * 	- saved: Saved copies, -2 for descriptors that were not touched
+******************************************************************************/
+void restore_redirs(int* saved) {
+	int k;
+	for (k = 9; k >= 0; k--) {
+		if (saved[k] != -2) {
+			restore_fd(k, saved[k]);
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Name: shell_redirs
+ * Description:
+ * 	Applies a stage's redirections to the shell itself
+ * 	The first change to each descriptor saves it for restore_redirs
+ * 	Returns 1 on success, or 0 with everything restored
+ * Parameters:
+ * 	- st: Pointer to the stage
+ *  - saved: Ten slots for the saved copies
+******************************************************************************/
+int shell_redirs(struct Stage* st, int* saved) {
+	int k;
+	for (k = 0; k < 10; k++) {
+		saved[k] = -2;
+	}
+	fflush(stdout);
+	for (k = 0; k < st->nredirs; k++) {
+		struct Redir* r = &st->redirs[k];
+		if (saved[r->fd] == -2) {
+			saved[r->fd] = fcntl(r->fd, F_DUPFD_CLOEXEC, 10);
+		}
+		if (!redirect_file(r)) {
+			redir_error(r, errno);
+			restore_redirs(saved);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+/******************************************************************************
+ * Name: sh_utility
+ * Description:
+ * 	Runs a utility built in inside the shell with its < > redirection
+ * 	stdin and stdout are saved, redirected and restored so no
+ * 	process is started
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - st: Pointer to the stage
+ *  - cmd: Command text for the stats log
+******************************************************************************/
+int sh_utility(struct Shell* s, struct Stage* st, const char* cmd) {
+	int saved[10];
+	if (!shell_redirs(st, saved)) {
+		s->recent = W_EXITCODE(1, 0);
+		return 0;
+	}
+
+	// Built ins are timed from the shell's own usage
+	struct timespec t0, t1;
+	struct rusage r0, r1, ru;
+	int measure = s->time_next || s->stat_log != NULL;
+	if (measure) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		getrusage(RUSAGE_SELF, &r0);
+	}
+
+	s->recent = W_EXITCODE(run_utility(st->argv), 0);
+
+	fflush(stdout);
+	if (measure) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		getrusage(RUSAGE_SELF, &r1);
+		memset(&ru, 0, sizeof(ru));
+		timersub(&r1.ru_utime, &r0.ru_utime, &ru.ru_utime);
+		timersub(&r1.ru_stime, &r0.ru_stime, &ru.ru_stime);
+		// No process of its own, so maxrss stays 0 rather than the shell's peak
+		ru.ru_nvcsw = r1.ru_nvcsw - r0.ru_nvcsw;
+		ru.ru_nivcsw = r1.ru_nivcsw - r0.ru_nivcsw;
+		double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+		report_stats(s, cmd, exit_code(s->recent), wall, &ru, s->time_next);
+	}
+	restore_redirs(saved);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: parse_cpus
+ * Description:
+ * 	Reads a CPU list like 0-3,6 into a CPU set
+ * Parameters:
+ * 	- list: CPU list
+ *  - set: CPU set to fill
+******************************************************************************/
+int parse_cpus(const char* list, cpu_set_t* set) {
+	CPU_ZERO(set);
+	const char* p = list;
+	while (*p != '\0') {
+		char* end;
+		long lo = strtol(p, &end, 10), hi = lo;
+		if (end == p || lo < 0) {
+			return -1;
+		}
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo) {
+				return -1;
+			}
+		}
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++) {
+			CPU_SET(lo, set);
+		}
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return -1;
+		}
+		p = end;
+	}
+	return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+
+/******************************************************************************
+ * Name: write_cgroup
+ * Description:
+ * 	Writes one control file of a cgroup
+ * Parameters:
+ * 	- dir: cgroup directory
+ *  - file: Control file name
+ *  - value: Value to write
+******************************************************************************/
+int write_cgroup(const char* dir, const char* file, const char* value) {
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1 || write(fd, value, strlen(value)) == -1) {
+		fprintf(stdout, "sched: %s: %s\n", path, strerror(errno));
+		fflush(stdout);
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	close(fd);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: open_cgroup
+ * Description:
+ * 	Creates a cgroup v2 group if needed and sets its limits
+ * 	The limits need their controllers enabled in the parent's
+ * 	cgroup.subtree_control, failures are reported and stop the job
+ * 	Returns its cgroup.procs open for writing pids
+ * Parameters:
+ * 	- name: Path under the cgroup root, or an absolute path
+ *  - mem: memory.max value or NULL
+ *  - cpu: CPU percent for cpu.max or NULL
+******************************************************************************/
+int open_cgroup(const char* name, const char* mem, const char* cpu) {
+	char dir[PATH_MAX];
+	if (name[0] == '/') {
+		snprintf(dir, sizeof(dir), "%s", name);
+	} else {
+		snprintf(dir, sizeof(dir), "%s/%s", CGROUP_ROOT, name);
+	}
+
+	// Controllers for the limits, enabling one twice is harmless
+	char parent[PATH_MAX];
+	snprintf(parent, sizeof(parent), "%s", dir);
+	char* slash = strrchr(parent, '/');
+	if (slash != NULL && slash != parent) {
+		*slash = '\0';
+	}
+	if (mem != NULL && write_cgroup(parent, "cgroup.subtree_control", "+memory") == -1) {
+		return -1;
+	}
+	if (cpu != NULL && write_cgroup(parent, "cgroup.subtree_control", "+cpu") == -1) {
+		return -1;
+	}
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+		fprintf(stdout, "sched: %s: %s\n", dir, strerror(errno));
+		fflush(stdout);
+		return -1;
+	}
+	if (mem != NULL && write_cgroup(dir, "memory.max", mem) == -1) {
+		return -1;
+	}
+	if (cpu != NULL) {
+		// Percent of one CPU per 100ms period
+		char quota[64];
+		snprintf(quota, sizeof(quota), "%ld 100000", atol(cpu) * 1000);
+		if (write_cgroup(dir, "cpu.max", quota) == -1) {
+			return -1;
+		}
+	}
+
+	char procs[PATH_MAX + 16];
+	snprintf(procs, sizeof(procs), "%s/cgroup.procs", dir);
+	int fd = open(procs, O_WRONLY | O_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stdout, "sched: %s: %s\n", procs, strerror(errno));
+		fflush(stdout);
+	}
+	return fd;
+}
+
+
+/******************************************************************************
+ * Name: parse_sched
+ * Description:
+ * 	Reads sched options into a set of controls
+ * 	Returns the index of the first word after them, -1 on errors
+ * Parameters:
+ * 	- sc: Controls to fill
+ *  - args: Array of strings starting with sched
+ *  - bg: Set when -b was given
+******************************************************************************/
+int parse_sched(struct Sched* sc, char** args, int* bg) {
+	const char* group = NULL;
+	const char* mem = NULL;
+	const char* cpu = NULL;
+	int i = 1;
+
+	while (args[i] != NULL && args[i][0] == '-') {
+		char opt = args[i][1];
+		if (opt == 'b' && args[i][2] == '\0') {
+			*bg = 1;
+			i++;
+			continue;
+		}
+		if (opt == '\0' || args[i][2] != '\0' || args[i + 1] == NULL) {
+			break;
+		}
+
+		const char* val = args[i + 1];
+		if (opt == 'c') {
+			if (parse_cpus(val, &sc->cpus) == -1) {
+				fprintf(stdout, "sched: bad CPU list %s\n", val);
+				fflush(stdout);
+				return -1;
+			}
+			sc->has_cpus = 1;
+		} else if (opt == 'n') {
+			sc->nice = atoi(val);
+			sc->has_nice = 1;
+		} else if (opt == 'i') {
+			// class[:level], levels only mean something for rt and be
+			int class = strncmp(val, "rt", 2) == 0 ? 1 : strncmp(val, "be", 2) == 0 ? 2 : strncmp(val, "idle", 4) == 0 ? 3 : 0;
+			const char* level = strchr(val, ':');
+			if (class == 0) {
+				fprintf(stdout, "sched: bad I/O class %s\n", val);
+				fflush(stdout);
+				return -1;
+			}
+			sc->ioprio = (class << IOPRIO_CLASS_SHIFT) | (level ? atoi(level + 1) & 7 : 4);
+		} else if (opt == 'g') {
+			group = val;
+		} else if (opt == 'm') {
+			mem = val;
+		} else if (opt == 'q') {
+			cpu = val;
+		} else {
+			break;
+		}
+		i += 2;
+	}
+
+	if ((mem != NULL || cpu != NULL) && group == NULL) {
+		fprintf(stdout, "sched: -m and -q need a cgroup (-g)\n");
+		fflush(stdout);
+		return -1;
+	}
+	if (group != NULL) {
+		sc->cg_fd = open_cgroup(group, mem, cpu);
+		if (sc->cg_fd == -1) {
+			return -1;
+		}
+	}
+
+	sc->active = sc->has_cpus || sc->has_nice || sc->ioprio || sc->cg_fd != -1;
+	return i;
+}
+
+
+/******************************************************************************
+ * Name: apply_sched
+ * Description:
+ * 	Applies scheduling controls to a process
+ * 	Children pass 0 to apply them to themselves before exec
+ * Parameters:
+ * 	- sc: Controls, or NULL for none
+ *  - pid: Process to change
+******************************************************************************/
+void apply_sched(struct Sched* sc, pid_t pid) {
+	if (sc == NULL || !sc->active) {
+		return;
+	}
+
+	// cgroup first, its limits then cover everything below
+	if (sc->cg_fd != -1) {
+		char num[32];
+		int len = snprintf(num, sizeof(num), "%d\n", pid);
+		if (write(sc->cg_fd, num, len) == -1) {
+			fprintf(stdout, "sched: cgroup: %s\n", strerror(errno));
+		}
+	}
+	if (sc->has_cpus && sched_setaffinity(pid, sizeof(cpu_set_t), &sc->cpus) == -1) {
+		fprintf(stdout, "sched: affinity: %s\n", strerror(errno));
+	}
+	if (sc->has_nice && setpriority(PRIO_PROCESS, pid, sc->nice) == -1) {
+		fprintf(stdout, "sched: nice: %s\n", strerror(errno));
+	}
+	if (sc->ioprio && syscall(SYS_ioprio_set, 1, pid, sc->ioprio) == -1) {
+		fprintf(stdout, "sched: ioprio: %s\n", strerror(errno));
+	}
+	fflush(stdout);
+}
+
+
+/******************************************************************************
+ * Name: sh_sched
+ * Description:
+ * 	Handles a sched prefix or sets the background defaults with -b
+ * 	Returns the index of the command to run, 0 if there is none
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_sched(struct Shell* s, char** args) {
+	int bg = 0;
+	clear_sched(&s->sched_next);
+	int i = parse_sched(&s->sched_next, args, &bg);
+	if (i == -1) {
+		clear_sched(&s->sched_next);
+		s->recent = W_EXITCODE(1, 0);
+		return 0;
+	}
+
+	// sched -b [options], defaults for every & job
+	if (bg) {
+		if (args[i] != NULL && strcmp(args[i], "off") != 0) {
+			fprintf(stdout, "usage: sched -b [options] | sched -b off\n");
+			fflush(stdout);
+			clear_sched(&s->sched_next);
+			return 0;
+		}
+		clear_sched(&s->sched_bg);
+		if (args[i] == NULL) {
+			s->sched_bg = s->sched_next;
+			s->sched_next.cg_fd = -1;
+		}
+		clear_sched(&s->sched_next);
+		return 0;
+	}
+
+	if (args[i] == NULL) {
+		fprintf(stdout, "usage: sched [-c cpus] [-n nice] [-i class[:level]] [-g cgroup [-m bytes] [-q percent]] cmd ...\n");
+		fflush(stdout);
+		clear_sched(&s->sched_next);
+		return 0;
+	}
+	return i;
+}
+
+
+/******************************************************************************
+ * Name: set_pipe_size
+ * Description:
+ * 	Resizes a pipe's kernel buffer with F_SETPIPE_SZ
+ * 	A size of 0 keeps the system default
+ * Parameters:
+ * 	- fd: Either end of the pipe
+ *  - size: Requested buffer size in bytes
+******************************************************************************/
+void set_pipe_size(int fd, int size) {
+	if (size <= 0) {
+		return;
+	}
+
+	// Best effort, the kernel caps unprivileged sizes at pipe-max-size
+	fcntl(fd, F_SETPIPE_SZ, size);
+}
+
+
+/******************************************************************************
+ * Name: write_all
+ * Description:
+ * 	Writes the whole buffer, retrying short writes
+ * 	Returns 0 on success and -1 on error
+ * Parameters:
+ * 	- fd: Destination descriptor
+ *  - buf: Data to write
+ *  - n: Number of bytes
+******************************************************************************/
+int write_all(int fd, const char* buf, size_t n) {
+	while (n > 0) {
+		ssize_t w = write(fd, buf, n);
+		if (w == -1) {
+			return -1;
+		}
+		buf += w;
+		n -= w;
+	}
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: pump_fds
+ * Description:
+ * 	Moves a stream from one descriptor to another inside the kernel
+ * 	Uses splice so the data never enters user space and tee to also
+ * 	copy it to a second pipe. Falls back to read/write into both
+ * 	when the descriptors are not pipes
+ * Parameters:
+ * 	- in: Source descriptor
+ *  - out: Destination descriptor
+ *  - tee_fd: Extra pipe to duplicate the stream into, or -1
+******************************************************************************/
+int pump_fds(int in, int out, int tee_fd) {
+	size_t pending = 0;
+	ssize_t n;
+
+	for (;;) {
+		size_t len = PUMP_CHUNK;
+
+		// Duplicate the pending pipe data without consuming it
+		if (tee_fd != -1) {
+			n = tee(in, tee_fd, len, 0);
+			if (n == 0) {
+				return 0;
+			}
+			if (n == -1) {
+				break;
+			}
+			len = n;
+		}
+
+		// Consume exactly what was tee'd, or as much as is ready
+		do {
+			n = splice(in, NULL, out, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (n <= 0) {
+				break;
+			}
+			len -= n;
+		} while (tee_fd != -1 && len > 0);
+
+		if (n == 0) {
+			return 0;
+		}
+		if (n == -1) {
+			// The tee'd bytes not yet spliced are already downstream
+			if (tee_fd != -1) {
+				pending = len;
+			}
+			break;
+		}
+	}
+
+	// Copy through user space instead, into both descriptors
+	char buf[PUMP_CHUNK];
+	while ((n = read(in, buf, pending > 0 ? pending : sizeof(buf))) > 0) {
+		if (write_all(out, buf, n) == -1) {
+			return -1;
+		}
+		if (pending > 0) {
+			pending -= n;
+		} else if (tee_fd != -1 && write_all(tee_fd, buf, n) == -1) {
+			return -1;
+		}
+	}
+	return n == 0 ? 0 : -1;
+}
+
+
+/******************************************************************************
+ * Name: here_document
+ * Description:
+ * 	Puts the text of a here string or here document in a memfd
+ * 	Here documents read the following input lines up to the delimiter
+ * 	Returns the memfd rewound to the start, or -1
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - word: Here string, or the delimiter
+ *  - doc: Non zero for a here document
+******************************************************************************/
+int here_document(struct Shell* s, const char* word, int doc) {
+	int fd = memfd_create("smallsh-here", MFD_CLOEXEC);
+	if (fd == -1) {
+		fprintf(stdout, "memfd error\n");
+		fflush(stdout);
+		return -1;
+	}
+
+	if (!doc) {
+		if (write(fd, word, strlen(word)) == -1 || write(fd, "\n", 1) == -1) {
+			fprintf(stdout, "here document: %s\n", strerror(errno));
+			fflush(stdout);
+			close(fd);
+			return -1;
+		}
+	} else {
+		// Lines are taken as is, without expansion
+		char* line;
+		for (;;) {
+			if (!s->batch) {
+				printf("> ");
+				fflush(stdout);
+			}
+			line = read_line(&s->in);
+			if (line == NULL || strcmp(line, word) == 0) {
+				break;
+			}
+			size_t len = strlen(line);
+			line[len] = '\n';
+			int failed = write(fd, line, len + 1) == -1;
+			line[len] = '\0';
+			if (failed) {
+				fprintf(stdout, "here document: %s\n", strerror(errno));
+				fflush(stdout);
+				close(fd);
+				return -1;
+			}
+		}
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+
+
+/******************************************************************************
+ * Name: close_redirs
+ * Description:
+ * 	Closes the memfds of here documents once a command is launched
+ * Parameters:
+ * 	- r: Array of redirections
+ *  - n: Number of redirections
+******************************************************************************/
+void close_redirs(struct Redir* r, int n) {
+	int k;
+	for (k = 0; k < n; k++) {
+		if (r[k].kind == REDIR_DATA && r[k].src != -1) {
+			close(r[k].src);
+		}
+	}
+}
+
+
+/******************************************************************************
+ * Name: parse_pipeline
+ * Description:
+ * 	Splits the args array into stages on |
+ * 	Pulls out each stage's redirections and a trailing &
+ * 	Only unquoted operators from the lexer count
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - count: Output for the number of stages
+ *  - bg_flag: Output for background execution
+******************************************************************************/
+struct Stage* parse_pipeline(struct Shell* s, int* count, int* bg_flag) {
+	char* ops = s->lex.ops;
+	int argc = 0, n = 1, nr = 0, i;
+
+	// Count args, stages and redirections before the operators are cut out
+	while (s->args[argc] != NULL) {
+		if (ops[argc] == '|') {
+			n++;
+		} else if (ops[argc] == '<' || ops[argc] == '>') {
+			nr++;
+		}
+		argc++;
+	}
+
+	// Stage and redirection arrays are reused between commands
+	if (n > s->stages_cap) {
+		struct Stage* tmp = (struct Stage*)realloc(s->stages, n * sizeof(struct Stage));
+		if (tmp == NULL) {
+			fprintf(stdout, "Allocation error\n");
+			fflush(stdout);
+			return NULL;
+		}
+		s->stages = tmp;
+		s->stages_cap = n;
+	}
+	if (nr > s->redirs_cap) {
+		struct Redir* tmp = (struct Redir*)realloc(s->redirs, nr * sizeof(struct Redir));
+		if (tmp == NULL) {
+			fprintf(stdout, "Allocation error\n");
+			fflush(stdout);
+			return NULL;
+		}
+		s->redirs = tmp;
+		s->redirs_cap = nr;
+	}
+	struct Stage* stages = s->stages;
+	memset(stages, 0, n * sizeof(struct Stage));
+
+	*bg_flag = 0;
+	n = 0;
+	nr = 0;
+	stages[0].argv = s->args;
+	stages[0].redirs = s->redirs;
+
+	// Parse arguments for redirections, | and &
+	// Words are packed down over the operators, so a command can go
+	// on after its redirections as in cat < in -n
+	int w = 0;
+	for (i = 0; i < argc; i++) {
+		if (ops[i] == 0 || (ops[i] == '&' && i != argc - 1)) {
+			// Only a trailing & means background, keep others as words
+			s->args[w++] = s->args[i];
+			continue;
+		}
+
+		if ((ops[i] == '<' || ops[i] == '>') && i + 1 < argc) {
+			// [n]< [n]> [n]>> [n]>&m [n]<&m <<< <<
+			const char* op = s->args[i];
+			struct Redir* r = &s->redirs[nr];
+			r->fd = ops[i] == '<' ? STDIN_FILENO : STDOUT_FILENO;
+			if (op[0] >= '0' && op[0] <= '9') {
+				r->fd = *op++ - '0';
+			}
+			r->target = s->args[i + 1];
+			r->src = -1;
+
+			if (strcmp(op, ">>") == 0) {
+				r->kind = REDIR_APPEND;
+			} else if (strcmp(op, ">&") == 0 || strcmp(op, "<&") == 0) {
+				// Only single digit descriptors, like the n in n>
+				if (r->target[0] < '0' || r->target[0] > '9' || r->target[1] != '\0') {
+					fprintf(stdout, "%s: bad file descriptor\n", r->target);
+					fflush(stdout);
+					close_redirs(s->redirs, nr);
+					return NULL;
+				}
+				r->kind = REDIR_DUP;
+				r->src = r->target[0] - '0';
+			} else if (strcmp(op, "<<<") == 0 || strcmp(op, "<<") == 0) {
+				r->kind = REDIR_DATA;
+				r->src = here_document(s, r->target, op[2] == '\0');
+				if (r->src == -1) {
+					close_redirs(s->redirs, nr);
+					return NULL;
+				}
+			} else {
+				r->kind = ops[i] == '<' ? REDIR_READ : REDIR_WRITE;
+			}
+			nr++;
+			stages[n].nredirs++;
+			i++;
+		} else if (ops[i] == '|') {
+			// Next stage starts after it
+			s->args[w++] = NULL;
+			stages[++n].argv = &s->args[w];
+			stages[n].redirs = &s->redirs[nr];
+		} else if (ops[i] == '&') {
+			*bg_flag = 1;
+		}
+	}
+	s->args[w] = NULL;
+
+	*count = n + 1;
+	return stages;
+}
+
+
+/******************************************************************************
+ * Name: run_stage
+ * Description:
+ * 	Runs one pipeline stage inside the forked child
+ * 	A stage with no command moves data between its redirections
+ * 	and the pipeline itself with pump_fds
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - st: Pointer to the stage
+ *  - last: Non zero for the final stage
+ *  - piped: Non zero when stdin is the previous stage's pipe
+ *  - err_fd: Pipe for reporting a failed redirection, or -1 to print it
+******************************************************************************/
+void run_stage(struct Shell* s, struct Stage* st, int last, int piped, int err_fd) {
+	// A pump stage keeps the pipe to tee into before stdout is redirected
+	int pipe_out = -1, k;
+	if (st->argv[0] == NULL && !last) {
+		pipe_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+	}
+
+	// Redirections in order, the shell reads failures from err_fd
+	for (k = 0; k < st->nredirs; k++) {
+		if (!redirect_file(&st->redirs[k])) {
+			int report[2] = {k, errno};
+			if (err_fd == -1 || write(err_fd, report, sizeof(report)) == -1) {
+				redir_error(&st->redirs[k], report[1]);
+			}
+			exit(1);
+		}
+	}
+	if (err_fd != -1) {
+		close(err_fd);
+	}
+
+	// No command, pump stdin to the output file and on down the pipe
+	// Only a pipe or a < gives it input, never the shell's own stdin
+	if (st->argv[0] == NULL) {
+		int tee_fd = -1;
+		for (k = 0; k < st->nredirs; k++) {
+			if (st->redirs[k].fd == STDOUT_FILENO) {
+				tee_fd = pipe_out;
+			}
+			if (st->redirs[k].fd == STDIN_FILENO) {
+				piped = 1;
+			}
+		}
+		if (!piped) {
+			exit(0);
+		}
+		exit(pump_fds(STDIN_FILENO, STDOUT_FILENO, tee_fd) == 0 ? 0 : 1);
+	}
+
+	// Built ins that make sense inside a pipeline
+	if (strcmp(st->argv[0], "status") == 0) {
+		exit(sh_status(s->recent));
+	}
+	int rc = run_utility(st->argv);
+	if (rc != -1) {
+		exit(rc);
+	}
+
+	// Repalce the current process with command
+	int err = ENOENT;
+	if (st->path != NULL) {
+		execv(st->path, st->argv);
+		err = errno;
+	}
+	exec_error(st->argv[0], err);
+
+	exit(1);
+}
+
+
+/******************************************************************************
+ * Name: stage_needs_fork
+ * Description:
+ * 	Checks if a stage has to run shell code in the child
+ * 	Pump stages and built ins can't be exec'd so they keep using fork,
+ * 	which is still cheaper than exec for the utility built ins
+ * Parameters:
+ * 	- st: Pointer to the stage
+******************************************************************************/
+int stage_needs_fork(struct Stage* st) {
+	return st->argv[0] == NULL || strcmp(st->argv[0], "status") == 0 || is_utility(st->argv[0]);
+}
+
+
+/******************************************************************************
+ * Name: spawn_error
+ * Description:
+ * 	Reports why a stage could not be launched
+ * 	posix_spawn only returns an errno, so a child replays the
+ * 	redirections and sends back the one that failed, like fork_stage.
+ * 	Opens before it already ran in the spawned child and later
+ * 	ones are never reached, so no file is touched that sh wouldn't
+ * Parameters:
+ * 	- st: Pointer to the stage
+ *  - err: Error returned by posix_spawn
+ *  - in_fd: Read end of the previous pipe, or -1
+ *  - out_fd: Write end of the next pipe, or -1
+******************************************************************************/
+void spawn_error(struct Stage* st, int err, int in_fd, int out_fd) {
+	int fds[2], report[2], k;
+	if (st->path != NULL && st->nredirs > 0 && pipe2(fds, O_CLOEXEC) == 0) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			// Keep the report pipe clear of descriptors the stage names
+			int report_fd = fcntl(fds[1], F_DUPFD_CLOEXEC, 10);
+			close(fds[0]);
+			close(fds[1]);
+			if (in_fd != -1) {
+				dup2(in_fd, STDIN_FILENO);
+			}
+			if (out_fd != -1) {
+				dup2(out_fd, STDOUT_FILENO);
+			}
+			for (k = 0; k < st->nredirs; k++) {
+				if (!redirect_file(&st->redirs[k])) {
+					report[0] = k;
+					report[1] = errno;
+					if (write(report_fd, report, sizeof(report)) == -1) {
+						redir_error(&st->redirs[k], report[1]);
+					}
+					_exit(1);
+				}
+			}
+			_exit(0);
+		}
+		close(fds[1]);
+
+		// EOF when every redirection opened, so the exec failed
+		int found = pid != -1 && read(fds[0], report, sizeof(report)) == sizeof(report);
+		close(fds[0]);
+		if (pid != -1) {
+			waitpid(pid, NULL, 0);
+		}
+		if (found) {
+			redir_error(&st->redirs[report[0]], report[1]);
+			return;
+		}
+	}
+	exec_error(st->argv[0], err);
+}
+
+
+/******************************************************************************
+ * Name: spawn_stage
+ * Description:
+ * 	Launches a stage with posix_spawn
+ * 	Pipes and < > become file actions and the SIGINT reset and
+ * 	signal mask become spawn attributes, so glibc can start the
+ * 	child with clone(CLONE_VM|CLONE_VFORK) and skip copying the
+ * 	shell's page tables. Returns the pid or -1
+ * Parameters:
+ * 	- st: Pointer to the stage
+ *  - in_fd: Read end of the previous pipe, or -1
+ *  - out_fd: Write end of the next pipe, or -1
+ *  - bg_flag: Non zero for background stages
+ *  - pgid: Process group to join, 0 for a new one, -1 for the shell's
+ *  - mask: Signal mask the child starts with
+******************************************************************************/
+pid_t spawn_stage(struct Stage* st, int in_fd, int out_fd, int bg_flag, pid_t pgid, sigset_t* mask) {
+	if (st->path == NULL) {
+		spawn_error(st, ENOENT, in_fd, out_fd);
+		return -1;
+	}
+
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawnattr_init(&attr);
+
+	// Wire up the pipe ends, the originals are closed on exec
+	if (in_fd != -1) {
+		posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+	}
+	if (out_fd != -1) {
+		posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+	}
+
+	// Redirections in order, opened by the child
+	int k;
+	for (k = 0; k < st->nredirs; k++) {
+		struct Redir* r = &st->redirs[k];
+		if (r->kind == REDIR_READ) {
+			posix_spawn_file_actions_addopen(&fa, r->fd, r->target, O_RDONLY, 0);
+		} else if (r->kind == REDIR_WRITE) {
+			posix_spawn_file_actions_addopen(&fa, r->fd, r->target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		} else if (r->kind == REDIR_APPEND) {
+			posix_spawn_file_actions_addopen(&fa, r->fd, r->target, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		} else {
+			posix_spawn_file_actions_adddup2(&fa, r->src, r->fd);
+		}
+	}
+
+	// Reset the job control signals the shell ignores, and SIGINT
+	// for foreground jobs, then restore the signal mask
+	sigset_t def;
+	sigemptyset(&def);
+	sigaddset(&def, SIGTTOU);
+	sigaddset(&def, SIGTTIN);
+	if (!bg_flag) {
+		sigaddset(&def, SIGINT);
+	}
+	posix_spawnattr_setsigdefault(&attr, &def);
+	posix_spawnattr_setsigmask(&attr, mask);
+	short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_USEVFORK;
+	if (pgid != -1) {
+		posix_spawnattr_setpgroup(&attr, pgid);
+		flags |= POSIX_SPAWN_SETPGROUP;
+	}
+	posix_spawnattr_setflags(&attr, flags);
+
+	pid_t pid;
+	int err = posix_spawn(&pid, st->path, &fa, &attr, st->argv, environ);
+
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+
+	if (err != 0) {
+		spawn_error(st, err, in_fd, out_fd);
+		return -1;
+	}
+	return pid;
+}
+
+
+/******************************************************************************
+ * Name: fork_stage
+ * Description:
+ * 	Launches a stage with fork for stages that run shell code
+ * 	Returns the pid or -1
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - st: Pointer to the stage
+ *  - in_fd: Read end of the previous pipe, or -1
+ *  - out_fd: Write end of the next pipe, or -1
+ *  - close_fd: Read end of the next pipe, closed in the child
+ *  - bg_flag: Non zero for background stages
+ *  - last: Non zero for the final stage
+ *  - pgid: Process group to join, 0 for a new one, -1 for the shell's
+ *  - mask: Signal mask the child starts with
+******************************************************************************/
+pid_t fork_stage(struct Shell* s, struct Stage* st, int in_fd, int out_fd, int close_fd, int bg_flag, int last, pid_t pgid, sigset_t* mask) {
+	// The child opens the redirections, failures come back on this pipe
+	int err[2] = {-1, -1};
+	if (st->nredirs > 0 && pipe2(err, O_CLOEXEC) == -1) {
+		err[0] = err[1] = -1;
+	}
+
+	// Fork a new process for execs
+	pid_t fork_result = fork();
+	if (fork_result == -1) {
+		fprintf(stdout, "Fork error\n");
+		fflush(stdout);
+		if (err[0] != -1) {
+			close(err[0]);
+			close(err[1]);
+		}
+		return -1;
+	}
+
+	// Child process
+	if (fork_result == 0) {
+		if (err[0] != -1) {
+			close(err[0]);
+		}
+		// Join the job's process group
+		if (pgid != -1) {
+			setpgid(0, pgid);
+		}
+
+		// Scheduling controls before anything of the job runs
+		apply_sched(s->sched_cur, 0);
+
+		// Default sigs
+		struct sigaction def_action = {0};
+		def_action.sa_handler = SIG_DFL;
+		sigaction(SIGTTOU, &def_action, NULL);
+		sigaction(SIGTTIN, &def_action, NULL);
+
+		// Reset SIGINT to default
+		if (!bg_flag) {
+			// If SIGINT, terminate like usual
+			sigaction(SIGINT, &def_action, NULL);
+		}
+		sigprocmask(SIG_SETMASK, mask, NULL);
+
+		// Wire up the pipe ends
+		if (in_fd != -1) {
+			dup2(in_fd, STDIN_FILENO);
+			close(in_fd);
+		}
+		if (out_fd != -1) {
+			dup2(out_fd, STDOUT_FILENO);
+			close(out_fd);
+		}
+		if (close_fd != -1) {
+			close(close_fd);
+		}
+		run_stage(s, st, last, in_fd != -1, err[1]);
+	}
+
+	// Set it here too so the group exists before the next stage joins
+	if (pgid != -1) {
+		setpgid(fork_result, pgid ? pgid : fork_result);
+	}
+
+	// EOF once the redirections are done, or a report of the failed one
+	if (err[0] != -1) {
+		int report[2];
+		close(err[1]);
+		if (read(err[0], report, sizeof(report)) == sizeof(report)) {
+			redir_error(&st->redirs[report[0]], report[1]);
+		}
+		close(err[0]);
+	}
+	return fork_result;
+}
+
+
+/******************************************************************************
+ * Name: sh_pipeline
+ * Description:
+ * 	Starts one child per stage connected by pipes as one job
+ * 	Waits for the job in the foreground or leaves it running
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - stages: Array of stages
+ *  - n: Number of stages
+ *  - job: Job the stages belong to
+******************************************************************************/
+int sh_pipeline(struct Shell* s, struct Stage* stages, int n, struct Job* job) {
+	// Hold SIGCHLD until the chain is launched and waited
+	sigset_t chld, old;
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old);
+
+	int prev_rd = -1, k;
+	for (k = 0; k < n; k++) {
+		int fds[2] = {-1, -1};
+
+		// Resolve in the parent so the cache outlives the child
+		if (!stage_needs_fork(&stages[k])) {
+			stages[k].path = resolve_command(s, stages[k].argv[0]);
+		}
+
+		// Pipe to the next stage, closed on exec in the children
+		if (k < n - 1) {
+			if (pipe2(fds, O_CLOEXEC) == -1) {
+				// Stages already started see EOF, the job fails
+				fprintf(stdout, "Pipe error\n");
+				fflush(stdout);
+				job->last = -1;
+				break;
+			}
+			set_pipe_size(fds[1], s->pipe_size);
+		}
+
+		// Job control only when interactive, scripts stay in the shell's group
+		pid_t pid, pgid = s->batch ? -1 : job->pgid;
+		if (s->force_fork || s->sched_cur != NULL || stage_needs_fork(&stages[k])) {
+			pid = fork_stage(s, &stages[k], prev_rd, fds[1], fds[0], job->bg, k == n - 1, pgid, &old);
+		} else {
+			pid = spawn_stage(&stages[k], prev_rd, fds[1], job->bg, pgid, &old);
+		}
+
+		// First stage to start leads the process group
+		if (pid != -1) {
+			if (job->pgid == 0) {
+				job->pgid = pid;
+			}
+			add_process(s, pid, job);
+			if (job->bg) {
+				printf("Background process %d started\n", pid);
+				fflush(stdout);
+			}
+		}
+		if (k == n - 1) {
+			job->last = pid;
+		}
+
+		// Parent keeps only the read end for the next stage
+		if (prev_rd != -1) {
+			close(prev_rd);
+		}
+		if (fds[1] != -1) {
+			close(fds[1]);
+		}
+		prev_rd = fds[0];
+	}
+	if (prev_rd != -1) {
+		close(prev_rd);
+	}
+
+	// Nothing started or the last stage failed to start
+	if (job->alive == 0 || job->last == -1) {
+		job->status = W_EXITCODE(1, 0);
+	}
+
+	if (job->alive == 0) {
+		if (!job->bg) {
+			s->recent = W_EXITCODE(1, 0);
+		}
+		free_job(s, job);
+	} else if (!job->bg) {
+		wait_for_job(s, job);
+	}
+
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: sh_pipesize
+ * Description:
+ * 	Shows or sets the buffer size used for new pipeline pipes
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_pipesize(struct Shell* s, char** args) {
+	if (args[1] == NULL) {
+		fprintf(stdout, "pipe size %d\n", s->pipe_size);
+	} else {
+		s->pipe_size = atoi(args[1]);
+	}
+	fflush(stdout);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: flush_output
+ * Description:
+ * 	Copies a finished job's captured output to stdout and closes it
+ * Parameters:
+ * 	- fd: memfd holding the output
+******************************************************************************/
+void flush_output(int fd) {
+	lseek(fd, 0, SEEK_SET);
+	pump_fds(fd, STDOUT_FILENO, -1);
+	close(fd);
+}
+
+
+/******************************************************************************
+ * Name: replace_slot
+ * Description:
+ * 	Copies a word with every {} replaced by the argument
+ * 	Returns the new string, the caller frees it
+ * Parameters:
+ * 	- word: Command word containing {}
+ *  - arg: Argument to put in its place
+******************************************************************************/
+char* replace_slot(const char* word, const char* arg) {
+	size_t slots = 0, alen = strlen(arg);
+	const char* p;
+	for (p = strstr(word, "{}"); p != NULL; p = strstr(p + 2, "{}")) {
+		slots++;
+	}
+
+	char* out = (char*)malloc(strlen(word) + slots * alen + 1);
+	if (out == NULL) {
+		return NULL;
+	}
+	char* o = out;
+	while ((p = strstr(word, "{}")) != NULL) {
+		memcpy(o, word, p - word);
+		o += p - word;
+		memcpy(o, arg, alen);
+		o += alen;
+		word = p + 2;
+	}
+	strcpy(o, word);
+	return out;
+}
+
+
+/******************************************************************************
+ * Name: sh_parallel
+ * Description:
+ * 	Runs cmd once per argument after ::: with at most N at a time
+ * 	{} in cmd is replaced by the argument, otherwise it is appended.
+ * 	A slot is refilled as soon as SIGCHLD says a job finished, and
+ * 	-k keeps each job's output in a memfd so it prints in order.
+ * 	Aggregate wall and CPU time go to stderr
+ * 	usage: parallel [-j N] [-k] cmd [args...] ::: arg...
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_parallel(struct Shell* s, char** args) {
+	int slots = 0, keep = 0, i = 1;
+
+	// Options
+	while (args[i] != NULL && args[i][0] == '-') {
+		if (strcmp(args[i], "-k") == 0) {
+			keep = 1;
+		} else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+			slots = atoi(args[++i]);
+		} else {
+			break;
+		}
+		i++;
+	}
+	if (slots <= 0) {
+		slots = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+
+	// Command words up to :::
+	char** cmd = &args[i];
+	int ncmd = 0, nargs = 0;
+	while (cmd[ncmd] != NULL && strcmp(cmd[ncmd], ":::") != 0) {
+		ncmd++;
+	}
+	if (ncmd == 0 || cmd[ncmd] == NULL) {
+		fprintf(stdout, "usage: parallel [-j N] [-k] cmd [args...] ::: arg...\n");
+		fflush(stdout);
+		return 0;
+	}
+	char** items = &cmd[ncmd + 1];
+	while (items[nargs] != NULL) {
+		nargs++;
+	}
+
+	int has_slot = 0, w;
+	for (w = 0; w < ncmd; w++) {
+		if (strstr(cmd[w], "{}") != NULL) {
+			has_slot = 1;
+		}
+	}
+
+	pid_t* running = (pid_t*)calloc(slots, sizeof(pid_t));
+	int* which = (int*)calloc(slots, sizeof(int));
+	int* outs = (int*)malloc(nargs * sizeof(int));
+	char* done = (char*)calloc(nargs + 1, 1);
+	char** argv = (char**)calloc(ncmd + 2, sizeof(char*));
+	if (!running || !which || !outs || !done || !argv) {
+		fprintf(stdout, "Allocation error\n");
+		fflush(stdout);
+		free(running);
+		free(which);
+		free(outs);
+		free(done);
+		free(argv);
+		return 1;
+	}
+
+	struct Stage st = {0};
+	st.argv = argv;
+	st.path = resolve_command(s, cmd[0]);
+
+	sigset_t mask;
+	sigprocmask(SIG_SETMASK, NULL, &mask);
+
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	struct timeval cpu_user = {0, 0}, cpu_sys = {0, 0};
+
+	int next = 0, active = 0, printed = 0, failed = 0;
+	while (next < nargs || active > 0) {
+		// Fill free slots
+		int k;
+		for (k = 0; k < slots && next < nargs; k++) {
+			if (running[k] != 0) {
+				continue;
+			}
+
+			// Build argv for this argument
+			for (w = 0; w < ncmd; w++) {
+				char* sub = strstr(cmd[w], "{}") != NULL ? replace_slot(cmd[w], items[next]) : NULL;
+				argv[w] = sub != NULL ? sub : cmd[w];
+			}
+			argv[ncmd] = has_slot ? NULL : items[next];
+			argv[ncmd + 1] = NULL;
+
+			int out = -1;
+			if (keep) {
+				out = memfd_create("parallel", MFD_CLOEXEC);
+			}
+			outs[next] = out;
+
+			// Stays in the shell's process group so ^C reaches it
+			pid_t pid = spawn_stage(&st, -1, out, 0, -1, &mask);
+			for (w = 0; w < ncmd; w++) {
+				if (argv[w] != cmd[w]) {
+					free(argv[w]);
+				}
+			}
+			if (pid == -1) {
+				failed++;
+				done[next] = 1;
+			} else {
+				apply_sched(s->sched_cur, pid);
+				running[k] = pid;
+				which[k] = next;
+				active++;
+			}
+			next++;
+		}
+
+		// Print finished outputs that are next in order
+		while (keep && printed < nargs && done[printed]) {
+			if (outs[printed] != -1) {
+				flush_output(outs[printed]);
+			}
+			printed++;
+		}
+
+		if (active == 0) {
+			continue;
+		}
+
+		// Sleep until SIGCHLD pokes the self pipe
+		struct pollfd pfd = {s->sig_pipe[0], POLLIN, 0};
+		char drain[64];
+		while (poll(&pfd, 1, -1) == -1 && errno == EINTR);
+		while (read(s->sig_pipe[0], drain, sizeof(drain)) > 0);
+
+		// Reap everything that finished, batch jobs free their slots
+		int stat;
+		struct rusage ru;
+		pid_t pid;
+		while ((pid = wait4(-1, &stat, WNOHANG, &ru)) > 0) {
+			for (k = 0; k < slots && running[k] != pid; k++);
+			if (k == slots) {
+				update_process(s, pid, stat, &ru);
+				continue;
+			}
+
+			running[k] = 0;
+			active--;
+			done[which[k]] = 1;
+			if (!WIFEXITED(stat) || WEXITSTATUS(stat) != 0) {
+				failed++;
+			}
+			timeradd(&cpu_user, &ru.ru_utime, &cpu_user);
+			timeradd(&cpu_sys, &ru.ru_stime, &cpu_sys);
+		}
+		fflush(stdout);
+	}
+
+	// Outputs of the last jobs
+	while (keep && printed < nargs) {
+		if (outs[printed] != -1) {
+			flush_output(outs[printed]);
+		}
+		printed++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	double user = cpu_user.tv_sec + cpu_user.tv_usec / 1e6;
+	double sys = cpu_sys.tv_sec + cpu_sys.tv_usec / 1e6;
+	fprintf(stderr, "parallel: %d jobs, %d failed, %d slots: wall %.3f s, cpu %.3f s (user %.3f, sys %.3f)\n",
+		nargs, failed, slots, wall, user + sys, user, sys);
+
+	s->recent = W_EXITCODE(failed ? 1 : 0, 0);
+	free(running);
+	free(which);
+	free(outs);
+	free(done);
+	free(argv);
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: sh_timelog
+ * Description:
+ * 	Starts appending per command stats to a file, or stops with off
+ * Parameters:
+ * 	- s: Pointer to shell structure
+ *  - args: Array of strings
+******************************************************************************/
+int sh_timelog(struct Shell* s, char** args) {
+	if (s->stat_log != NULL) {
+		fclose(s->stat_log);
+		s->stat_log = NULL;
+	}
+	if (args[1] == NULL || strcmp(args[1], "off") == 0) {
+		return 0;
+	}
+
+	s->stat_log = fopen(args[1], "ae");
+	if (s->stat_log == NULL) {
+		fprintf(stdout, "%s: No such file or directory\n", args[1]);
+		fflush(stdout);
+	}
+	return 0;
+}
+
+
+/******************************************************************************
+ * Name: join_args
+ * Description:
+ * 	Joins the args back into one command string
+ * 	A trailing & is left out, jobs shows it from the job state
+ * Parameters:
+ * 	- args: Array of strings
+ *  - ops: Operator flags from the lexer
+******************************************************************************/
+char* join_args(char** args, const char* ops) {
+	size_t len = 1;
+	int i, n;
+	for (n = 0; args[n] != NULL; n++) {
+		len += strlen(args[n]) + 1;
+	}
+	if (n > 0 && ops[n - 1] == '&') {
+		n--;
+	}
+
+	char* cmd = (char*)malloc(len);
+	if (cmd == NULL) {
+		return NULL;
+	}
+
+	char* w = cmd;
+	for (i = 0; i < n; i++) {
+		size_t n = strlen(args[i]);
+		if (i > 0) {
+			*w++ = ' ';
+		}
+		memcpy(w, args[i], n);
+		w += n;
+	}
+	*w = '\0';
+	return cmd;
+}
+
+
+/******************************************************************************
+ * Name: sh_execute
+ * Description:
+ * 	 Executes commands in the shell
+ * 		- Built ins
+ * 		- Process pipelines
+ * Parameters:
+ * 	- s: Pointer to shell structure
+******************************************************************************/
+int sh_execute(struct Shell* s) {
+	// No command
+    if (s->args[0] == NULL) {
+        return 0; 
+    }
+
+	// time prefix, drop the word and time what follows
+	s->time_next = 0;
+	if (strcmp(s->args[0], "time") == 0 && s->args[1] != NULL) {
+		size_t argc = 0;
+		while (s->args[argc] != NULL) {
+			argc++;
+		}
+		memmove(s->args, s->args + 1, argc * sizeof(char*));
+		memmove(s->lex.ops, s->lex.ops + 1, argc);
+		s->time_next = 1;
+	}
+
+	// sched prefix, drop the options and run what follows under them
+	s->sched_cur = NULL;
+	if (strcmp(s->args[0], "sched") == 0) {
+		int skip = sh_sched(s, s->args);
+		if (skip == 0) {
+			return 0;
+		}
+
+		size_t argc = 0;
+		while (s->args[argc] != NULL) {
+			argc++;
+		}
+		memmove(s->args, s->args + skip, (argc - skip + 1) * sizeof(char*));
+		memmove(s->lex.ops, s->lex.ops + skip, argc - skip);
+		s->sched_cur = &s->sched_next;
+	}
+
+	// The prefixes need a command to time or place, not the shell itself
+	// parallel takes sched for its jobs and prints its own totals
+	if ((s->time_next || s->sched_cur != NULL) &&
+		(is_shell_builtin(s->args[0]) || (s->time_next && strcmp(s->args[0], "parallel") == 0))) {
+		fprintf(stdout, "%s: cannot be used with %s\n", s->time_next ? "time" : "sched", s->args[0]);
+		fflush(stdout);
+		s->recent = W_EXITCODE(1, 0);
+		return 0;
+	}
+
+	// Built ins
+    if (strcmp(s->args[0], "exit") == 0) {
+        sh_exit(s);
+    } else if (strcmp(s->args[0], "cd") == 0) {
+        return sh_cd(s->args);
+    } else if (strcmp(s->args[0], "status") == 0) {
+        return sh_status(s->recent);
+    } else if (strcmp(s->args[0], "pipesize") == 0) {
+        return sh_pipesize(s, s->args);
+    } else if (strcmp(s->args[0], "hash") == 0) {
+        return sh_hash(s, s->args);
+    } else if (strcmp(s->args[0], "jobs") == 0) {
+        return sh_jobs(s);
+    } else if (strcmp(s->args[0], "fg") == 0) {
+        return sh_fg(s, s->args);
+    } else if (strcmp(s->args[0], "bg") == 0) {
+        return sh_bg(s, s->args);
+    } else if (strcmp(s->args[0], "wait") == 0) {
+        return sh_wait(s, s->args);
+    } else if (strcmp(s->args[0], "timelog") == 0) {
+        return sh_timelog(s, s->args);
+    }
+
+	// Keep the command text for jobs before the operators are cut out
+    char* cmd = join_args(s->args, s->lex.ops);
+
+	// Flag for background execs
+    int bg_flag = 0, n = 0;
+    struct Stage* stages = parse_pipeline(s, &n, &bg_flag);
+    if (stages == NULL) {
+        // Already reported, the shell goes on with the next command
+        s->recent = W_EXITCODE(1, 0);
+        free(cmd);
+        return 0;
+    }
+
+    // & is ignored in foreground-only mode
+    if (s->fg_mode) {
+        bg_flag = 0;
+    }
+
+    // Background defaults from sched -b
+    if (s->sched_cur == NULL && bg_flag && s->sched_bg.active) {
+        s->sched_cur = &s->sched_bg;
+    }
+
+    // Here document memfds are closed once the command is launched
+    int k, a, b, nr = 0, result;
+    for (k = 0; k < n; k++) {
+        nr += stages[k].nredirs;
+    }
+
+    // Prevent same file for input and output
+    for (k = 0; k < n; k++) {
+        struct Redir* r = stages[k].redirs;
+        for (a = 0; a < stages[k].nredirs; a++) {
+            for (b = 0; b < stages[k].nredirs; b++) {
+                if (r[a].kind == REDIR_READ && (r[b].kind == REDIR_WRITE || r[b].kind == REDIR_APPEND) &&
+                    strcmp(r[a].target, r[b].target) == 0) {
+                    fprintf(stdout, "Same file error\n");
+                    fflush(stdout);
+                    close_redirs(s->redirs, nr);
+                    free(cmd);
+                    s->recent = W_EXITCODE(1, 0);
+                    return 0;
+                }
+            }
+        }
+    }
+
+    // parallel runs in the shell, its redirections apply to every job
+    if (stages[0].argv[0] != NULL && strcmp(stages[0].argv[0], "parallel") == 0) {
+        int saved[10];
+        if (n > 1 || bg_flag) {
+            fprintf(stdout, "parallel: cannot be used in a pipeline or with &\n");
+            fflush(stdout);
+            s->recent = W_EXITCODE(1, 0);
+        } else if (!shell_redirs(&stages[0], saved)) {
+            s->recent = W_EXITCODE(1, 0);
+        } else {
+            sh_parallel(s, stages[0].argv);
+            fflush(stdout);
+            restore_redirs(saved);
+        }
+        close_redirs(s->redirs, nr);
+        free(cmd);
+        return 0;
+    }
+
+    // Lone redirections only open and truncate their files, like sh
+    if (n == 1 && !bg_flag && stages[0].argv[0] == NULL) {
+        int saved[10];
+        if (shell_redirs(&stages[0], saved)) {
+            restore_redirs(saved);
+            s->recent = W_EXITCODE(0, 0);
+        } else {
+            s->recent = W_EXITCODE(1, 0);
+        }
+        close_redirs(s->redirs, nr);
+        free(cmd);
+        return 0;
+    }
+
+    // Lone foreground utility built ins run without a process
+    if (n == 1 && !bg_flag && s->sched_cur == NULL && stages[0].argv[0] != NULL && is_utility(stages[0].argv[0])) {
+        result = sh_utility(s, &stages[0], cmd);
+        close_redirs(s->redirs, nr);
+        free(cmd);
+        return result;
+    }
+
+    struct Job* job = new_job(s, cmd, bg_flag);
+    if (job == NULL) {
+        fprintf(stdout, "Allocation error\n");
+        fflush(stdout);
+        close_redirs(s->redirs, nr);
+        free(cmd);
+        return 1;
+    }
+
+    result = sh_pipeline(s, stages, n, job);
+    close_redirs(s->redirs, nr);
+    return result;
+}
+
+
+/******************************************************************************
+ * Name: grow_buffer
+ * Description:
+ * 	Makes sure a reusable buffer holds at least need bytes
+ * 	Grows geometrically so repeated long lines stop reallocating
+ * Parameters:
+ * 	- buf: Pointer to the buffer
+ *  - cap: Pointer to its capacity
+ *  - need: Required size in bytes
 ******************************************************************************/
-void build_pids(struct Shell* s){
-	// Error handling
-	if(s == NULL){
-		return;
+int grow_buffer(char** buf, size_t* cap, size_t need) {
+	if (need <= *cap) {
+		return 1;
 	}
-	s->bg_pids = NULL;
-	s->bg_count = 0;
+
+	size_t size = *cap ? *cap : BUFF_SIZE;
+	while (size < need) {
+		size *= 2;
+	}
+
+	char* tmp = (char*)realloc(*buf, size);
+	if (tmp == NULL) {
+		fprintf(stdout, "Allocation error\n");
+		fflush(stdout);
+		return 0;
+	}
+	*buf = tmp;
+	*cap = size;
+	return 1;
 }
 
 
 /******************************************************************************
- * Name: build_shell
+ * Name: read_line
  * Description:
- * 	Initializes default shell struct
+ * 	Reads a line of input
+ * 	Input is read in READ_BLOCK chunks. A line that sits whole in the
+ * 	block is returned in place, otherwise it is stitched together in
+ * 	the reader's line buffer. Returns NULL at EOF
  * Parameters:
- * 	- s: Pointer to shell structure
+ * 	- r: Pointer to the input reader
 ******************************************************************************/
-void build_shell(struct Shell* s) {
-	// Error handling
-	if (s == NULL){
-		return;
+char* read_line(struct Reader* r){
+	if (r->buf == NULL) {
+		r->buf = (char*)malloc(READ_BLOCK);
+		if (r->buf == NULL) {
+			fprintf(stdout, "Allocation error \n");
+			fflush(stdout);
+			return NULL;
+		}
 	}
 
-	s->bg_pids = NULL;
-	s->fg_mode = 0;
-	s->recent = 0;
-	s->current = 0;
-	s->args = NULL;
+	char* line = NULL;
+	size_t n = 0;
+	for (;;) {
+		// Refill the block
+		if (r->pos == r->len) {
+			// Reap background processes while waiting for input
+			if (r->wake_fd != -1) {
+				struct pollfd pfd[2] = {{r->fd, POLLIN, 0}, {r->wake_fd, POLLIN, 0}};
+				if (poll(pfd, 2, -1) == -1 && errno != EINTR) {
+					return NULL;
+				}
+				if (pfd[1].revents & POLLIN) {
+					reap_children(smallsh);
+				}
+				if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+					continue;
+				}
+			}
+			ssize_t got = read(r->fd, r->buf, READ_BLOCK);
+			if (got == -1 && errno == EINTR) {
+				continue;
+			}
+			// EOF
+			if (got <= 0) {
+				if (line == NULL) {
+					return NULL;
+				}
+				break;
+			}
+			r->len = got;
+			r->pos = 0;
+		}
 
-	build_pids(s);
+		char* start = r->buf + r->pos;
+		size_t avail = r->len - r->pos;
+		char* nl = (char*)memchr(start, '\n', avail);
+
+		// Whole line in the block, hand it out without copying
+		if (nl != NULL && line == NULL) {
+			*nl = '\0';
+			r->pos += nl - start + 1;
+			line = start;
+			break;
+		}
+
+		// Line spans blocks, stitch it together
+		size_t take = nl ? (size_t)(nl - start) : avail;
+		if (!grow_buffer(&r->line, &r->line_cap, n + take + 1)) {
+			return NULL;
+		}
+		memcpy(r->line + n, start, take);
+		n += take;
+		r->pos += take + (nl ? 1 : 0);
+		line = r->line;
+		line[n] = '\0';
+		if (nl != NULL) {
+			break;
+		}
+	}
+
+    return line;
 }
 
 
+
 /******************************************************************************
- * Name: terminate_processes
+ * Name: lex_put
  * Description:
- * 	Terminates all background processes 
- * 	Frees the linked list of processes
+ * 	Appends bytes to the token text buffer
  * Parameters:
- * 	- s: Pointer to shell structure
+ * 	- lx: Pointer to the lexer
+ *  - str: Bytes to append
+ *  - len: Number of bytes
 ******************************************************************************/
-void terminate_processes(struct Shell* s) {
-	struct Process* temp = s->bg_pids;
-    struct Process* prev = NULL;
-
-    while (temp != NULL) {
-		// Kill and wait for process to exit
-        kill(temp->val, SIGTERM);  
-        waitpid(temp->val, NULL, 0); 
-
-        // Move to the next process before freeing current one
-        prev = temp;
-        temp = temp->next;
-        free(prev);
-    }
-
-    // Reset the linked list
-    s->bg_pids = NULL;
-    s->bg_count = 0;
+int lex_put(struct Lexer* lx, const char* str, size_t len) {
+	if (!grow_buffer(&lx->text, &lx->text_cap, lx->text_len + len + 1)) {
+		return 0;
+	}
+	memcpy(lx->text + lx->text_len, str, len);
+	lx->text_len += len;
+	return 1;
 }
 
 
 /******************************************************************************
- * Name: sh_exit
+ * Name: lex_end
  * Description:
- * 	Terminals all background process 
- * 	Frees allocated memory 
- * 	Exits shell
+ * 	Terminates the current token and records where it starts
+ * 	Offsets are kept until the end since the text buffer can move
  * Parameters:
- * 	- s: Pointer to shell structure
- *  - input: Pointer to user input
+ * 	- lx: Pointer to the lexer
+ *  - start: Offset of the token in the text buffer
+ *  - op: Operator character, or 0 for a word
 ******************************************************************************/
-int sh_exit(struct Shell* s, char* input) {
-	if (s) {
-        terminate_processes(s);
-        free_shell(s);
-    }
-    
-    if (input) {
-        free(input);
-    }
+int lex_end(struct Lexer* lx, size_t start, char op) {
+	if (lx->argc + 2 > lx->argv_cap) {
+		size_t cap = lx->argv_cap ? lx->argv_cap * 2 : 64;
+		char** argv = (char**)realloc(lx->argv, cap * sizeof(char*));
+		if (argv == NULL) {
+			return 0;
+		}
+		lx->argv = argv;
+		char* ops = (char*)realloc(lx->ops, cap);
+		if (ops == NULL) {
+			return 0;
+		}
+		lx->ops = ops;
+		lx->argv_cap = cap;
+	}
 
-	exit(0);
+	if (!lex_put(lx, "", 1)) {
+		return 0;
+	}
+	lx->argv[lx->argc] = (char*)(uintptr_t)start;
+	lx->ops[lx->argc] = op;
+	lx->argc++;
+	return 1;
 }
 
 
 /******************************************************************************
- * Name: sh_cd
+ * Name: glob_meta
  * Description:
- * 	Changes the current working directory
- * 	If there is no argument, then it defaults to home directory
+ * 	Checks a pattern for unescaped *, ? or a [...] class
  * Parameters:
- * 	- args: Array of strings 
+ * 	- pat: Pattern, \ escapes the next character
+ *  - len: Length of the pattern
 ******************************************************************************/
-int sh_cd(char** args){
-	// Check if there are arguements
-	// Else change to dir
-	if (args[1] == NULL) {
-        chdir(getenv("HOME"));
-    } else if (chdir(args[1]) != 0) {
-		fprintf(stdout, "CD error\n");
-		fflush(stdout);
+int glob_meta(const char* pat, size_t len) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		if (pat[i] == '\\') {
+			i++;
+		} else if (pat[i] == '*' || pat[i] == '?') {
+			return 1;
+		} else if (pat[i] == '[' && memchr(pat + i + 1, ']', len - i - 1) != NULL) {
+			return 1;
+		}
 	}
 	return 0;
 }
 
 
 /******************************************************************************
- * Name: redirect_file
+ * Name: glob_add
  * Description:
- * 	 Handles input and output file redirection for the shel
+ * 	Appends a match to a growing list
  * Parameters:
- * 	- fileName: Name of the redirected file
- *  - flag: An int representing in (0) and out (1)
+ * 	- list: Pointer to the list
+ *  - count: Pointer to its length
+ *  - cap: Pointer to its capacity
+ *  - path: Match to copy in
 ******************************************************************************/
-int redirect_file(char* fileName, int flag) {
-	// Dont work
-    if (fileName == NULL) {
-		return 0;  
+int glob_add(char*** list, size_t* count, size_t* cap, const char* path) {
+	if (*count == *cap) {
+		size_t n = *cap ? *cap * 2 : 16;
+		char** grown = (char**)realloc(*list, n * sizeof(char*));
+		if (grown == NULL) {
+			return 0;
+		}
+		*list = grown;
+		*cap = n;
 	}
-
-	// Default file descriptor
-    int fd = -1;
-
-	// flag Redirection
-    if (flag == 0) {  
-        fd = open(fileName, O_RDONLY);
-		// Failed
-        if (fd == -1) {
-            fprintf(stdout, "%s: No such file or directory\n", fileName);
-			fflush(stdout);
-            return 0;  
-        }
-        dup2(fd, STDIN_FILENO);
-    }  else if (flag == 1) {  
-		// Output Redirection
-        fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-		// Failed
-        if (fd == -1) {
-            fprintf(stdout, "%s: No such file or directory\n", fileName);
-			fflush(stdout);
-            return 0;  
-        }
-        dup2(fd, STDOUT_FILENO);
-    }
-
-    close(fd);
-    return 1;  
+	if (((*list)[*count] = strdup(path)) == NULL) {
+		return 0;
+	}
+	(*count)++;
+	return 1;
 }
 
 
-
 /******************************************************************************
- * Name: sh_execute
+ * Name: glob_walk
  * Description:
- * 	 Executes commands in the shell
- * 		- Built ins
- * 		- Process
+ * 	Matches the pattern one path component at a time
+ * 	Components without wildcards are joined without listing anything
  * Parameters:
  * 	- s: Pointer to shell structure
- *  - input: Pointer to user input
+ *  - prefix: Path matched so far, empty or ending in /
+ *  - rest: Remaining pattern
+ *  - list, count, cap: Matches found
 ******************************************************************************/
-int sh_execute(struct Shell* s, char* input) {
-	// No command
-    if (s->args[0] == NULL) {
-        return 0; 
-    }
-
-	// Built ins
-    if (strcmp(s->args[0], "exit") == 0) {
-        sh_exit(s, input);
-    } else if (strcmp(s->args[0], "cd") == 0) {
-        return sh_cd(s->args);
-    } else if (strcmp(s->args[0], "status") == 0) {
-        return sh_status();
-    }
-
-	// Flag for background execs
-    int bg_flag = 0, i = 0;
-
-	// Ini Redirection Variables
-    char* infile = NULL;
-    char* outfile = NULL;
-
-    // Parse argsuments for < > and &
-    while (s->args[i] != NULL) {
-        if (strcmp(s->args[i], "<") == 0 && s->args[i + 1] != NULL) {
-            infile = s->args[i + 1];  
-			// Remove operator
-            s->args[i] = NULL;  
-        }
-        else if (strcmp(s->args[i], ">") == 0 && s->args[i + 1] != NULL) {
-            outfile = s->args[i + 1];  
-			// Remove operator
-            s->args[i] = NULL;  
-        }
-        else if (strcmp(s->args[i], "&") == 0) {
-            bg_flag = 1;
-			// Remove operator
-            s->args[i] = NULL;  
-        }
-        i++;
-    }
-
-    // Prevent same file for input and output
-    if (infile && outfile && strcmp(infile, outfile) == 0) {
-        fprintf(stdout, "Same file error\n");
-		fflush(stdout);
-        return 1;
-    }
+void glob_walk(struct Shell* s, const char* prefix, const char* rest, char*** list, size_t* count, size_t* cap) {
+	const char* slash = strchr(rest, '/');
+	size_t clen = slash ? (size_t)(slash - rest) : strlen(rest);
+	size_t plen = strlen(prefix);
 
-	// Fork a new process for execs
-    pid_t fork_result = fork();
-    if (fork_result == -1) {
-        fprintf(stdout, "Fork error\n");
-		fflush(stdout);
-        return 1;
-    }
-
-	// Child process
-    if (fork_result == 0) {  
-		// Reset SIGINT to default
-        if (!bg_flag) {
-			// Default sigs 
-            struct sigaction def_action = {0};
-			// If SIGINT, terminate like usual
-            def_action.sa_handler = SIG_DFL;
-			// New sig
-            sigaction(SIGINT, &def_action, NULL);
-        }
-
-        // Input rd
-        if (infile && !redirect_file(infile, 0)) {
-            exit(1);
-        }
+	char* path = (char*)malloc(plen + NAME_MAX + clen + 3);
+	if (path == NULL) {
+		return;
+	}
+	memcpy(path, prefix, plen);
 
-        // Output
-        if (outfile && !redirect_file(outfile, 1)) {
-            exit(1);
-        }
+	if (!glob_meta(rest, clen)) {
+		// Literal component, drop the escapes
+		size_t i, w = plen;
+		for (i = 0; i < clen; i++) {
+			if (rest[i] == '\\' && i + 1 < clen) {
+				i++;
+			}
+			path[w++] = rest[i];
+		}
+		if (slash != NULL) {
+			path[w++] = '/';
+		}
+		path[w] = '\0';
 
-		// Repalce the current process with command
-        execvp(s->args[0], s->args);
-        fprintf(stdout, "%s: command not found\n", s->args[0]);
-		fflush(stdout);
+		struct stat sb;
+		if (slash == NULL || slash[1] == '\0') {
+			if (lstat(path, &sb) == 0) {
+				glob_add(list, count, cap, path);
+			}
+		} else {
+			glob_walk(s, path, slash + 1, list, count, cap);
+		}
+		free(path);
+		return;
+	}
 
-        exit(1);
-		// Parent Process
-    }  else {  
-        if (!bg_flag) {
-			// Wait for child to finish and get status
-            int stat;
-            waitpid(fork_result, &stat, 0);
-			// Store exit stat
-            s->recent = WEXITSTATUS(stat);
-        } else {
-            printf("Background process %d started\n", fork_result);
-            fflush(stdout);
+	char* comp = strndup(rest, clen);
+	path[plen] = '\0';
+	struct DirListing* d = comp ? read_dir(s, plen ? path : ".") : NULL;
+	size_t k;
+	for (k = 0; d != NULL && k < d->count; k++) {
+		// Leading dots only match a pattern that starts with one
+		if (fnmatch(comp, d->names[k], FNM_PERIOD) != 0) {
+			continue;
+		}
+		snprintf(path + plen, NAME_MAX + 2, "%s%s", d->names[k], slash ? "/" : "");
 
-			// Allocate memory for processes
-            struct Process* p = (struct Process*)malloc(sizeof(struct Process));
-            // Store process variables
-			p->val = fork_result;
-            p->next = s->bg_pids;
-			// Insert at head
-            s->bg_pids = p;
-            s->bg_count++;
-        }
-    }
-    return 0;
+		struct stat sb;
+		if (slash == NULL) {
+			glob_add(list, count, cap, path);
+		} else if (slash[1] == '\0') {
+			if (stat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+				glob_add(list, count, cap, path);
+			}
+		} else {
+			glob_walk(s, path, slash + 1, list, count, cap);
+		}
+	}
+	free(comp);
+	free(path);
 }
 
 
 /******************************************************************************
- * Name: expandShVar
+ * Name: lex_word
  * Description:
- * 	 Expands occurences of $$
- * 	 Replaces dollas with pid 
+ * 	Ends a word and expands it if it has unquoted wildcards
+ * 	Matches replace the word in sorted order, no match keeps it as typed
  * Parameters:
  * 	- s: Pointer to shell structure
- *  - input: Pointer to user input
+ *  - start: Offset where the word's text begins
+ *  - glob: Non zero if the lexer marked wildcards in the word
 ******************************************************************************/
-char* expandShVar(char* line) {
-	// Error handling
-    if (line == NULL) {
-        return NULL;
-    }
-
-	// Get length of input
-    size_t len = strlen(line);
-    char pidStr[16]; 
-	// Get pid and store in pid buffer
-    snprintf(pidStr, sizeof(pidStr), "%d", getpid());  
-
-	// Count occurrences of dolla signs
-    size_t count = 0;
-	// Make sure i is positive
-	size_t i;
-    for (i = 0; i < len - 1; i++) {
-		// Check $ followed by $
-        if (line[i] == '$' && line[i + 1] == '$') {
-            count++;
-        }
-    }
-
-	// Original length + extra space to replace
-	// Get length of array
-	size_t pidLen = strlen(pidStr);
-	// -2 since dolla dolla
-	// Calculate required size
-    size_t newSize = len + (count * (pidLen - 2)) + 1; 
-	// Allocate enough memory to expanded 
-    char* result = (char*)calloc(newSize, sizeof(char));
-    if (!result) {
-        fprintf(stdout, "Allocation error\n");
-		fflush(stdout);
+int lex_word(struct Shell* s, size_t start, int glob) {
+	struct Lexer* lx = &s->lex;
+	if (!glob) {
+		return lex_end(lx, start, 0);
+	}
 
-        return NULL;
-    }
+	// Marked characters stay wildcards, everything else is escaped
+	size_t n = lx->text_len - start, i, j = 0, w = start;
+	char* pat = (char*)malloc(2 * n + 1);
+	if (pat == NULL) {
+		return 0;
+	}
+	for (i = start; i < lx->text_len; i++) {
+		char c = lx->text[i];
+		if (c == GLOB_MARK) {
+			c = lx->text[++i];
+		} else if (c == '*' || c == '?' || c == '[' || c == '\\') {
+			pat[j++] = '\\';
+		}
+		pat[j++] = c;
+		lx->text[w++] = c;
+	}
+	pat[j] = '\0';
+	lx->text_len = w;
 
-    char* r_ptr = line;
-    char* w_ptr = result;
+	char** list = NULL;
+	size_t count = 0, cap = 0;
+	if (glob_meta(pat, j)) {
+		if (pat[0] == '/') {
+			glob_walk(s, "/", pat + 1, &list, &count, &cap);
+		} else {
+			glob_walk(s, "", pat, &list, &count, &cap);
+		}
+	}
+	free(pat);
 
-    while (*r_ptr) {
-		// If we find $ followed by $, replace w pid
-        if (*r_ptr == '$' && *(r_ptr + 1) == '$') {
-            strcpy(w_ptr, pidStr);
-            w_ptr += strlen(pidStr);
-            r_ptr += 2;
-        } else {
-            *w_ptr++ = *r_ptr++;
-        }
-    }
-	// Terminate with null term
-    *w_ptr = '\0';
+	if (count == 0) {
+		free(list);
+		return lex_end(lx, start, 0);
+	}
 
-    return result;
+	qsort(list, count, sizeof(char*), compare_names);
+	lx->text_len = start;
+	int ok = 1;
+	for (i = 0; i < count; i++) {
+		size_t at = lx->text_len;
+		if (ok && !(lex_put(lx, list[i], strlen(list[i])) && lex_end(lx, at, 0))) {
+			ok = 0;
+		}
+		free(list[i]);
+	}
+	free(list);
+	return ok;
 }
 
 
 /******************************************************************************
- * Name: read_line
+ * Name: lex_var
  * Description:
- * 	Reads a line of input and expands 
+ * 	Expands $$, $?, $NAME or ${NAME} at p into the token
+ * 	Returns the number of input bytes used, 0 for a plain $
  * Parameters:
- * 	- None
+ * 	- s: Pointer to shell structure
+ *  - p: Pointer to the $
 ******************************************************************************/
-char* read_line(){
-    char* line = (char*)calloc(BUFF_SIZE, sizeof(char));
-    if (line == NULL) {
-        fprintf(stdout, "Allocation error \n");
-		fflush(stdout);
-        return NULL;
-    }
-
-	// EOF
-    if (fgets(line, BUFF_SIZE, stdin) == NULL) {
-        free(line);
-        return NULL; 
-    }
+size_t lex_var(struct Shell* s, const char* p) {
+	char num[16];
+	const char* val = NULL;
+	size_t used = 0;
 
-    // Remove newline
-    line[strcspn(line, "\n")] = '\0';
+	if (p[1] == '$') {
+		snprintf(num, sizeof(num), "%d", getpid());
+		val = num;
+		used = 2;
+	} else if (p[1] == '?') {
+		snprintf(num, sizeof(num), "%d", exit_code(s->recent));
+		val = num;
+		used = 2;
+	} else {
+		int brace = p[1] == '{';
+		const char* name = p + 1 + brace;
+		size_t len = 0;
+		while (name[len] == '_' || (name[len] >= 'A' && name[len] <= 'Z') ||
+			(name[len] >= 'a' && name[len] <= 'z') || (len > 0 && name[len] >= '0' && name[len] <= '9')) {
+			len++;
+		}
+		if (len == 0 || (brace && name[len] != '}')) {
+			return 0;
+		}
 
-    // Ignore comments
-    if (line[0] == '#') {
-        free(line);
-        return NULL;  
-    }
+		// Look the name up in place, no copy
+		extern char** environ;
+		char** env;
+		for (env = environ; *env != NULL; env++) {
+			if (strncmp(*env, name, len) == 0 && (*env)[len] == '=') {
+				val = *env + len + 1;
+				break;
+			}
+		}
+		used = 1 + brace + len + brace;
+	}
 
-    char* exp = expandShVar(line);
-    free(line);
-    return exp;
+	if (val != NULL && !lex_put(&s->lex, val, strlen(val))) {
+		return (size_t)-1;
+	}
+	return used;
 }
 
 
-
-
 /******************************************************************************
  * Name: split_line
  * Description:
  * 	Parses the input into an array of tokens/args/commands 
+ * 	One pass handles whitespace, '...' and "..." quoting, backslash
+ * 	escapes, # comments and $$ $? $NAME ${NAME} expansion. Unquoted
+ * 	< > | & are operators even without spaces around them. Tokens
+ * 	and argv are built in the shell's reusable lexer buffers so a
+ * 	command allocates nothing once they have grown
  * Parameters:
- * 	- line: Pointer to input string
+ * 	- s: Pointer to shell structure
+ *  - line: Pointer to input string
 ******************************************************************************/
-char** split_line(char* line) {
+char** split_line(struct Shell* s, char* line) {
 	if(line == NULL){
 		return NULL;
 	}
 
-	char** tokens = (char**)calloc(MAX_ARGS, sizeof(char*));
-	char* rest = NULL;
-	char* token;
-	int pos = 0;
-	
-	if(!tokens){
-		fprintf(stdout, "Allocation error \n");
-		fflush(stdout);
+	struct Lexer* lx = &s->lex;
+	lx->text_len = 0;
+	lx->argc = 0;
 
-		return NULL;
-	}
+	const char* p = line;
+	size_t start = 0;
+	int in_word = 0, glob = 0, quoted = 0;
+	char quote = 0;
 
-	token = strtok_r(line, " ", &rest);
-	while(token != NULL){
-		tokens[pos] = token;
-		pos++;
+	while (*p) {
+		char c = *p;
 
-		if(pos >= BUFF_SIZE){
-			fprintf(stdout, "Exceeds Maxium Arguments\n" );
-			fflush(stdout);
+		if (quote == '\'') {
+			// Everything up to the closing quote is literal
+			if (c == '\'') {
+				quote = 0;
+			} else if (!lex_put(lx, p, 1)) {
+				return NULL;
+			}
+			p++;
+			continue;
+		}
+
+		if (c == '\\' && p[1] != '\0') {
+			if (!in_word) {
+				start = lx->text_len;
+				in_word = 1;
+			}
+			quoted = 1;
+			// Inside "..." only \ $ and " are escapable
+			if (quote == '"' && p[1] != '\\' && p[1] != '$' && p[1] != '"') {
+				if (!lex_put(lx, p, 2)) {
+					return NULL;
+				}
+			} else if (!lex_put(lx, p + 1, 1)) {
+				return NULL;
+			}
+			p += 2;
+			continue;
+		}
+
+		if (c == '$') {
+			if (!in_word) {
+				start = lx->text_len;
+				in_word = 1;
+			}
+			size_t used = lex_var(s, p);
+			if (used == (size_t)-1) {
+				return NULL;
+			}
+			if (used > 0) {
+				quoted = 1;
+				p += used;
+				continue;
+			}
+		}
+
+		if (quote == '"') {
+			if (c == '"') {
+				quote = 0;
+			} else if (!lex_put(lx, p, 1)) {
+				return NULL;
+			}
+			p++;
+			continue;
+		}
 
-			free(tokens);
+		if (c == ' ' || c == '\t' || c == '\n' || c == '#' ||
+			c == '<' || c == '>' || c == '|' || c == '&') {
+			// A # that does not start a word is part of it
+			if (c == '#' && in_word) {
+				if (!lex_put(lx, p, 1)) {
+					return NULL;
+				}
+				p++;
+				continue;
+			}
+
+			// A lone digit right before < or > names the descriptor, as in 2>
+			int fd_word = in_word && !quoted && (c == '<' || c == '>') &&
+				lx->text_len - start == 1 && lx->text[start] >= '0' && lx->text[start] <= '9';
+
+			// Close the current word
+			if (in_word && !fd_word) {
+				if (!lex_word(s, start, glob)) {
+					return NULL;
+				}
+			}
+			in_word = 0;
+			glob = 0;
+			quoted = 0;
+
+			// Comment runs to the end of the line
+			if (c == '#') {
+				break;
+			}
+
+			// Operator token, redirections take >> >& <& << and <<<
+			if (c != ' ' && c != '\t' && c != '\n') {
+				size_t len = 1;
+				if (c == '>' && (p[1] == '>' || p[1] == '&')) {
+					len = 2;
+				} else if (c == '<' && p[1] == '<') {
+					len = p[2] == '<' ? 3 : 2;
+				} else if (c == '<' && p[1] == '&') {
+					len = 2;
+				}
+				if (!fd_word) {
+					start = lx->text_len;
+				}
+				if (!lex_put(lx, p, len) || !lex_end(lx, start, c)) {
+					return NULL;
+				}
+				p += len;
+				continue;
+			}
+			p++;
+			continue;
+		}
+
+		if (!in_word) {
+			start = lx->text_len;
+			in_word = 1;
+		}
+		if (c == '\'' || c == '"') {
+			quote = c;
+			quoted = 1;
+		} else if (c == '*' || c == '?' || c == '[') {
+			// Unquoted wildcard, marked so quoted ones stay literal
+			char mark[2] = {GLOB_MARK, c};
+			if (!lex_put(lx, mark, 2)) {
+				return NULL;
+			}
+			glob = 1;
+		} else if (!lex_put(lx, p, 1)) {
+			return NULL;
+		}
+		p++;
+	}
+
+	if (quote) {
+		fprintf(stdout, "Unterminated %c quote\n", quote);
+		fflush(stdout);
+		return NULL;
+	}
+	if (in_word && !lex_word(s, start, glob)) {
+		return NULL;
+	}
+
+	// The text buffer is final, turn offsets into pointers
+	size_t i;
+	for (i = 0; i < lx->argc; i++) {
+		lx->argv[i] = lx->text + (uintptr_t)lx->argv[i];
+	}
+	if (lx->argv == NULL) {
+		if (!lex_end(lx, 0, 0)) {
 			return NULL;
 		}
-		token = strtok_r(NULL, " ", &rest);
+		lx->argc = 0;
 	}
-	tokens[pos] = NULL;
-	return tokens;
+	lx->argv[lx->argc] = NULL;
+	lx->ops[lx->argc] = 0;
+	return lx->argv;
 }
 
 
@@ -509,19 +3996,32 @@ char** split_line(char* line) {
  * Description:
  * 	Prints the exit status of the alast exec'd process
  * Parameters:
- * 	- status: An int representing the exit status
+ * 	- status: Wait status of the process
 ******************************************************************************/
 int sh_status(int status){
-    if (status < 2) {
-        fprintf(stdout, "exit value %d\n", status);
+    if (WIFSIGNALED(status)) {
+        fprintf(stdout, "terminated by signal %d\n", WTERMSIG(status));
     } else {
-        fprintf(stdout, "terminated by signal %d\n", status);
+        fprintf(stdout, "exit value %d\n", WEXITSTATUS(status));
     }
 	fflush(stdout);
     return 0;
 }
 
 
+/******************************************************************************
+ * Name: exit_code
+ * Description:
+ * 	Turns a wait status into a $? style code, 128 plus the signal
+ * 	number for a process killed by a signal
+ * Parameters:
+ * 	- status: Wait status of the process
+******************************************************************************/
+int exit_code(int status) {
+	return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+
 /******************************************************************************
  * Name: SIGINT_handler
  * Description:
@@ -536,14 +4036,18 @@ void SIGINT_handler(int signal_number){
 	}
 
 	// Ignore SIGINT
-	if (smallsh->current != 0) {
-		// Kill the foreground process
-        kill(smallsh->current, SIGINT); 
+	if (smallsh->fg_pgid != 0) {
+		// Kill the foreground job, unless the terminal already did
+        if (!smallsh->batch && smallsh->tty_fd == -1) {
+            kill(-smallsh->fg_pgid, SIGINT); 
+        }
         write(STDOUT_FILENO, "\n", 1);
     }
 
-    write(STDOUT_FILENO, ": ", 2);
-    fflush(stdout);
+	// No prompt in script mode
+	if (!smallsh->batch) {
+		write(STDOUT_FILENO, ": ", 2);
+	}
 }
 
 
@@ -564,14 +4068,17 @@ void SIGTSTP_handler(int signal_number){
 	smallsh->fg_mode = !smallsh->fg_mode;
 
 	if (smallsh->fg_mode){
-		char* msg = "\nEntering foreground-only mode (& is now ignored)\n: ";
+		char* msg = "\nEntering foreground-only mode (& is now ignored)\n";
         write(STDOUT_FILENO, msg, strlen(msg));
 	} else {
-		char* msg = "\nExiting foreground-only mode\n: ";
+		char* msg = "\nExiting foreground-only mode\n";
         write(STDOUT_FILENO, msg, strlen(msg));
 	}
-	write(STDOUT_FILENO, ": ", 2);
-	fflush(stdout);
+
+	// No prompt in script mode
+	if (!smallsh->batch) {
+		write(STDOUT_FILENO, ": ", 2);
+	}
 
 }
 
@@ -580,35 +4087,21 @@ void SIGTSTP_handler(int signal_number){
  * Name: zombie_handler
  * Description:
  * 	Handles SIGCHLD signal
- * 	Cleans up zombie background processes
+ * 	Wakes the main loop through the self pipe, reap_children does
+ * 	the cleanup outside signal context
  * Parameters:
  * 	- signal_number: Integer that represents the signal that triggered the signal
 ******************************************************************************/
 void zombie_handler(int signal_number) {
-    int child_pid, child_status;
-    struct Process** prev = &smallsh->bg_pids;
-    struct Process* curr = smallsh->bg_pids;
-
-    while ((child_pid = waitpid(-1, &child_status, WNOHANG)) > 0) {
-        if (WIFEXITED(child_status)) {
-            printf("Background process %d is done: exit value %d\n", child_pid, WEXITSTATUS(child_status));
-        } else if (WIFSIGNALED(child_status)) {
-            printf("Background process %d is done: terminated by signal %d\n", child_pid, WTERMSIG(child_status));
-        }
-        fflush(stdout);
+	// Error handling
+	if (smallsh == NULL) {
+		return;
+	}
 
-        // Remove from linked list
-        while (curr != NULL) {
-            if (curr->val == child_pid) {
-                *prev = curr->next;
-                free(curr);
-                smallsh->bg_count--;
-                break;
-            }
-            prev = &curr->next;
-            curr = curr->next;
-        }
-    }
+	// A full pipe already has a wakeup pending
+	int saved = errno;
+	write(smallsh->sig_pipe[1], "c", 1);
+	errno = saved;
 }
 
 
@@ -645,7 +4138,8 @@ int build_handlers(int signal_number, void (*handler)(int)){
 /******************************************************************************
  * Name: loop
  * Description:
- * 	Runs the main interactive loop of the shell
+ * 	Runs the main loop of the shell
+ * 	Prompts are skipped in script mode
  * Parameters:
  * 	- s: Pointer to shell structure
 ******************************************************************************/
@@ -653,31 +4147,33 @@ void loop(struct Shell* s){
 	char* line;
 
 	do {
-		printf(": ");
-		fflush(stdout);
+		// Finished background processes, before the prompt
+		reap_children(s);
 
-		line = read_line();
+		if (!s->batch) {
+			printf(": ");
+			fflush(stdout);
+		}
+
+		line = read_line(&s->in);
 		if (line == NULL) {
-            continue;  // Skip this iteration if read_line failed
+            sh_exit(s);  // EOF ends the shell like exit
         }
 
-        s->args = split_line(line);
+        s->args = split_line(s, line);
         if (s->args == NULL) {
-            free(line);
             continue;  // Skip execution if splitting fails
         }
 
-		s->current = sh_execute(s, line);
-
-		free(line);
-		free(s->args);
-
-		line = NULL;
+		if (s->args[0] != NULL) {
+			s->commands++;
+		}
+		s->current = sh_execute(s);
 		s->args = NULL;
 	} while (s->current == 0);
 }
 
-int main() {
+int main(int argc, char* argv[]) {
 	// Good luck, and have fun! There's a lot to learn from this assignment
 	// :)
 	// Memory Allocation
@@ -693,6 +4189,51 @@ int main() {
 	build_shell(s);
 	smallsh = s;
 
+	// Script mode for smallsh file.sh or piped input
+	s->in.fd = STDIN_FILENO;
+	if (argc > 1) {
+		s->in.fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (s->in.fd == -1) {
+			fprintf(stdout, "%s: No such file or directory\n", argv[1]);
+			fflush(stdout);
+			free_shell(s);
+			exit(1);
+		}
+		s->script = argv[1];
+	}
+	s->batch = argc > 1 || !isatty(STDIN_FILENO);
+
+	// Self pipe for SIGCHLD wakeups
+	if (pipe2(s->sig_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+		fprintf(stdout, "Pipe error\n");
+		fflush(stdout);
+		free_shell(s);
+		exit(1);
+	}
+	s->in.wake_fd = s->sig_pipe[0];
+
+	// Per command stats log from the environment
+	if (getenv("SMALLSH_STATLOG") != NULL) {
+		char* log_args[] = {"timelog", getenv("SMALLSH_STATLOG"), NULL};
+		sh_timelog(s, log_args);
+	}
+
+	// SMALLSH_LAUNCH=fork turns off posix_spawn, for comparisons
+	if (getenv("SMALLSH_LAUNCH") != NULL && strcmp(getenv("SMALLSH_LAUNCH"), "fork") == 0) {
+		s->force_fork = 1;
+	}
+
+	// Interactive job control, take over the terminal
+	if (!s->batch) {
+		signal(SIGTTOU, SIG_IGN);
+		signal(SIGTTIN, SIG_IGN);
+		setpgid(0, 0);
+		s->shell_pgid = getpgrp();
+		if (tcsetpgrp(STDIN_FILENO, s->shell_pgid) == 0) {
+			s->tty_fd = STDIN_FILENO;
+		}
+	}
+
 	// Buiild signal handlers
 	if (build_handlers(SIGINT, SIGINT_handler) == -1 || 
 		build_handlers(SIGTSTP, SIGTSTP_handler) == -1 || 
@@ -705,6 +4246,9 @@ int main() {
 	loop(s);
 
 	// Free memory
+	if (s->batch) {
+		report_timing(s);
+	}
 	free_shell(s);
 	return 0;
 }
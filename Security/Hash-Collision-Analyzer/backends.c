@@ -0,0 +1,375 @@
+#include "configs.h"
+
+// Selected backend, set once by select_backend before any thread starts
+static const struct HashBackend* backend = NULL;
+
+// OpenSSL digest of the selected backend, when it has one
+static EVP_MD* backend_md = NULL;
+
+
+/******************************************************************************
+ * Name: read64, read32
+ * Description:
+ *     Little endian loads for the non-cryptographic hashes
+ * Parameters:
+ *     - p: Bytes to read
+******************************************************************************/
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+#define ROTL64(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+/******************************************************************************
+ * Name: xxh64
+ * Description:
+ *     XXH64 with seed 0
+ * Parameters:
+ *     - data, len: Input bytes
+******************************************************************************/
+static uint64_t xxh64(const void* data, size_t len) {
+    const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL;
+    const uint64_t P3 = 0x165667B19E3779F9ULL, P4 = 0x85EBCA77C2B2AE63ULL;
+    const uint64_t P5 = 0x27D4EB2F165667C5ULL;
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v[4] = {P1 + P2, P2, 0, -P1};
+        int i;
+        for (; p + 32 <= end; p += 32) {
+            for (i = 0; i < 4; i++) {
+                v[i] += read64(p + i * 8) * P2;
+                v[i] = ROTL64(v[i], 31) * P1;
+            }
+        }
+        h = ROTL64(v[0], 1) + ROTL64(v[1], 7) + ROTL64(v[2], 12) + ROTL64(v[3], 18);
+        for (i = 0; i < 4; i++) {
+            uint64_t k = ROTL64(v[i] * P2, 31) * P1;
+            h = (h ^ k) * P1 + P4;
+        }
+    } else {
+        h = P5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        uint64_t k = ROTL64(read64(p) * P2, 31) * P1;
+        h ^= k;
+        h = ROTL64(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = ROTL64(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = ROTL64(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    return h ^ (h >> 32);
+}
+
+
+/******************************************************************************
+ * Name: fmix64
+ * Description:
+ *     MurmurHash3 finalizer
+ * Parameters:
+ *     - k: Value to mix
+******************************************************************************/
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xFF51AFD7ED558CCDULL;
+    k ^= k >> 33;
+    k *= 0xC4CEB9FE1A85EC53ULL;
+    return k ^ (k >> 33);
+}
+
+
+/******************************************************************************
+ * Name: murmur3
+ * Description:
+ *     First half of MurmurHash3_x64_128 with seed 0, as its bytes read
+ *     big endian, so the truncation keeps the first digest bytes like SHA
+ * Parameters:
+ *     - data, len: Input bytes
+******************************************************************************/
+static uint64_t murmur3(const void* data, size_t len) {
+    const uint64_t c1 = 0x87C37B91114253D5ULL, c2 = 0x4CF5AD432745937FULL;
+    const unsigned char* p = (const unsigned char*)data;
+    uint64_t h1 = 0, h2 = 0, k1 = 0, k2 = 0;
+    size_t i, blocks = len / 16, tail = len & 15;
+
+    for (i = 0; i < blocks; i++, p += 16) {
+        k1 = read64(p);
+        k2 = read64(p + 8);
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = ROTL64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = ROTL64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+    }
+
+    k1 = k2 = 0;
+    for (i = tail; i > 8; i--) {
+        k2 ^= (uint64_t)p[i - 1] << ((i - 9) * 8);
+    }
+    if (tail > 8) {
+        k2 *= c2; k2 = ROTL64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (i = tail < 8 ? tail : 8; i > 0; i--) {
+        k1 ^= (uint64_t)p[i - 1] << ((i - 1) * 8);
+    }
+    if (tail > 0) {
+        k1 *= c1; k1 = ROTL64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    return __builtin_bswap64(h1);
+}
+
+
+/******************************************************************************
+ * Name: blake3
+ * Description:
+ *     First 8 bytes of BLAKE3, big endian, for inputs of up to one block
+ *     A single block is one chunk and the root, so one compression
+ * Parameters:
+ *     - data, len: Input bytes, len <= 64
+******************************************************************************/
+static uint64_t blake3(const void* data, size_t len) {
+    static const uint32_t iv[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+    static const unsigned char perm[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+    unsigned char block[64] = {0};
+    uint32_t m[16], t[16], v[16];
+    int r, i;
+
+    memcpy(block, data, len);
+    for (i = 0; i < 16; i++) {
+        m[i] = read32(block + i * 4);
+    }
+    memcpy(v, iv, sizeof(iv));
+    memcpy(v + 8, iv, 4 * sizeof(uint32_t));
+    v[12] = 0;
+    v[13] = 0;
+    v[14] = (uint32_t)len;
+    v[15] = 1 | 2 | 8;  // CHUNK_START | CHUNK_END | ROOT
+
+#define G(a, b, c, d, x, y)                                     \
+    v[a] += v[b] + (x); v[d] = ROTR32(v[d] ^ v[a], 16);         \
+    v[c] += v[d];       v[b] = ROTR32(v[b] ^ v[c], 12);         \
+    v[a] += v[b] + (y); v[d] = ROTR32(v[d] ^ v[a], 8);          \
+    v[c] += v[d];       v[b] = ROTR32(v[b] ^ v[c], 7)
+
+    for (r = 0; r < 7; r++) {
+        G(0, 4, 8, 12, m[0], m[1]);
+        G(1, 5, 9, 13, m[2], m[3]);
+        G(2, 6, 10, 14, m[4], m[5]);
+        G(3, 7, 11, 15, m[6], m[7]);
+        G(0, 5, 10, 15, m[8], m[9]);
+        G(1, 6, 11, 12, m[10], m[11]);
+        G(2, 7, 8, 13, m[12], m[13]);
+        G(3, 4, 9, 14, m[14], m[15]);
+        for (i = 0; i < 16; i++) {
+            t[i] = m[perm[i]];
+        }
+        memcpy(m, t, sizeof(m));
+    }
+#undef G
+
+    // Output words are little endian, the first two make the first 8 bytes
+    return (uint64_t)__builtin_bswap32(v[0] ^ v[8]) << 32 | __builtin_bswap32(v[1] ^ v[9]);
+}
+
+
+/******************************************************************************
+ * Name: evp_batch, xxh64_batch, murmur3_batch, blake3_batch
+ * Description:
+ *     Batch entry points of the backends, truncated like digest_data
+ * Parameters:
+ *     - strs: count strings of CAND_STRIDE characters, back to back
+ *     - count: Number of candidates
+ *     - hashes: count truncated hashes
+******************************************************************************/
+static int evp_batch(const char* strs, int count, uint64_t* hashes) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (!evp_digest(backend_md, strs + i * CAND_STRIDE, hashes + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#define NATIVE_BATCH(name, fn)                                              \
+static int name(const char* strs, int count, uint64_t* hashes) {           \
+    int i, shift = 64 - hash_bits;                                          \
+    for (i = 0; i < count; i++) {                                           \
+        hashes[i] = fn(strs + i * CAND_STRIDE, cand_len) >> shift;          \
+    }                                                                       \
+    return 1;                                                               \
+}
+
+NATIVE_BATCH(xxh64_batch, xxh64)
+NATIVE_BATCH(murmur3_batch, murmur3)
+NATIVE_BATCH(blake3_batch, blake3)
+
+
+/******************************************************************************
+ * Name: check_native
+ * Description:
+ *     Known answers for the hashes implemented here
+ * Parameters:
+ *     - name: Backend name
+******************************************************************************/
+static int check_native(const char* name) {
+    static const char fox[] = "The quick brown fox jumps over the lazy dog";
+    static const unsigned char zero = 0;
+
+    if (strcmp(name, "xxh64") == 0) {
+        return xxh64("", 0) == 0xEF46DB3751D8E999ULL && xxh64("abc", 3) == 0x44BC2CF5AD770999ULL;
+    }
+    if (strcmp(name, "murmur3") == 0) {
+        return murmur3("", 0) == 0 && murmur3(fox, sizeof(fox) - 1) == 0x6C1B07BC7BBC4BE3ULL;
+    }
+    if (strcmp(name, "blake3") == 0) {
+        return blake3("", 0) == 0xAF1349B9F5F9A1A6ULL && blake3(&zero, 1) == 0x2D3ADEDFF11B61F1ULL;
+    }
+    return 1;
+}
+
+
+// Every backend. sha256 uses the kernels in sha256.c, the other OpenSSL
+// digests go through EVP one candidate at a time
+static const struct HashBackend backends[] = {
+    {"sha256", NULL, sha256_batch},
+    {"sha1", "SHA1", evp_batch},
+    {"md5", "MD5", evp_batch},
+    {"sha512-256", "SHA512-256", evp_batch},
+    {"blake2s", "BLAKE2S-256", evp_batch},
+    {"blake2b", "BLAKE2B-512", evp_batch},
+    {"blake3", NULL, blake3_batch},
+    {"xxh64", NULL, xxh64_batch},
+    {"murmur3", NULL, murmur3_batch},
+};
+
+
+/******************************************************************************
+ * Name: backend_count
+ * Description:
+ *     Number of backends, for listing them with backend_at
+ * Parameters:
+ *     - None
+******************************************************************************/
+int backend_count() {
+    return (int)(sizeof(backends) / sizeof(backends[0]));
+}
+
+
+/******************************************************************************
+ * Name: backend_at
+ * Description:
+ *     Name of backend i
+ * Parameters:
+ *     - i: Index below backend_count
+******************************************************************************/
+const char* backend_at(int i) {
+    return backends[i].name;
+}
+
+
+/******************************************************************************
+ * Name: select_backend
+ * Description:
+ *     Picks the hash behind digest_batch. Returns 0 if it is unknown,
+ *     missing from OpenSSL or fails its known answers
+ * Parameters:
+ *     - name: Backend name
+******************************************************************************/
+int select_backend(const char* name) {
+    int i;
+
+    EVP_MD_free(backend_md);
+    backend_md = NULL;
+    backend = NULL;
+    for (i = 0; i < backend_count(); i++) {
+        if (strcmp(name, backends[i].name) != 0) {
+            continue;
+        }
+        if (backends[i].evp_name != NULL &&
+            (backend_md = EVP_MD_fetch(NULL, backends[i].evp_name, NULL)) == NULL) {
+            return 0;
+        }
+        if (!check_native(name)) {
+            return 0;
+        }
+        backend = &backends[i];
+        return 1;
+    }
+    return 0;
+}
+
+
+/******************************************************************************
+ * Name: backend_name
+ * Description:
+ *     Name of the selected backend
+ * Parameters:
+ *     - None
+******************************************************************************/
+const char* backend_name() {
+    return backend != NULL ? backend->name : "none";
+}
+
+
+/******************************************************************************
+ * Name: free_backend
+ * Description:
+ *     Releases the selected backend's OpenSSL digest
+ * Parameters:
+ *     - None
+******************************************************************************/
+void free_backend() {
+    EVP_MD_free(backend_md);
+    backend_md = NULL;
+    backend = NULL;
+}
+
+
+/******************************************************************************
+ * Name: digest_batch
+ * Description:
+ *     Hashes count candidates with the selected backend, truncated to
+ *     hash_bits. SHA-256 until a backend is selected
+ * Parameters:
+ *     - strs: count strings of CAND_STRIDE characters, back to back
+ *     - count: Number of candidates
+ *     - hashes: count truncated hashes
+******************************************************************************/
+int digest_batch(const char* strs, int count, uint64_t* hashes) {
+    return backend != NULL ? backend->batch(strs, count, hashes) : sha256_batch(strs, count, hashes);
+}
@@ -6,26 +6,194 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>     
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <math.h>
 #include <openssl/evp.h>
 
+// Default widths, --bits and --length change them at runtime
+#ifndef HASH_LENGTH
 #define HASH_LENGTH     3
+#endif
+#ifndef BUFF_SIZE
 #define BUFF_SIZE       8
-#define BUCKETS         16777216
+#endif
+#define MAX_BITS        64
+#define MAX_BUFF        16
+#define CAND_STRIDE     (MAX_BUFF + 1)
+
+// Strong table, perfect for hashes up to TABLE_BITS wide
+#define TABLE_BITS      24
+#define BUCKETS         (1 << TABLE_BITS)
 #define MAX_ATTEMPTS    9999999999
+#define CHECK_BATCH     4096
+
+// Candidates hashed per digest_batch call, a multiple of every kernel's lanes
+#define DIGEST_BATCH    16
+
+// Distinguished points, values whose top bits are zero
+// dp_trial picks hash_bits / 2 - 10 of them, about a thousand points per trial
+#define DP_SLOTS        65536
+#define DP_MAX_CHAIN    20
+
+// Candidate characters
+#define ALPHABET        " ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+#define ALPHABET_SIZE   27
+
+
+// Strong collision table slot, one uint64_t per bucket
+// Low SLOT_CAND_BITS bits hold the candidate index, the rest the generation
+// of the trial that wrote it. Older generations read as empty
+#define SLOT_CAND_BITS  40
+#define SLOT_CAND_MASK  ((1ULL << SLOT_CAND_BITS) - 1)
+#define SLOT_GEN_LIMIT  (1ULL << (64 - SLOT_CAND_BITS))
+
+
+// Truncated hash width in bits and candidate length in characters
+// Set in main before any thread starts. Hashes are the top hash_bits bits
+// of the digest as an integer, so comparing and indexing them is the same
+// single operation at every width
+extern int hash_bits;
+extern int cand_len;
+
+
+// Counter candidate, the string and its base 27 digits, lowest first
+typedef struct Odometer {
+    char str[CAND_STRIDE];
+    unsigned char digits[MAX_BUFF];
+} Odometer;
+
+
+// Weak search worker
+// Thread t hashes candidates t, t + T, t + 2T, ... of one interleaved stream
+typedef struct WeakWorker {
+    pthread_t thread;
+    int running;
+    int id;
+    int threads;
+    uint64_t seed;
+    uint64_t start;
+    const char* target_str;
+    uint64_t target;
+    long long limit;
+    atomic_llong* best;
+} WeakWorker;
+
+
+// Hash backend, batch hashes count candidates of CAND_STRIDE characters
+// evp_name is the OpenSSL digest behind it, NULL when implemented here
+struct HashBackend {
+    const char* name;
+    const char* evp_name;
+    int (*batch)(const char* strs, int count, uint64_t* hashes);
+};
+
+
+// Benchmark thread, hashes for a fixed time and reports its count
+typedef struct BenchWorker {
+    pthread_t thread;
+    int running;
+    uint64_t start;
+    double seconds;
+    long long hashes;
+} BenchWorker;
+
+
+// SHA-256 kernel for one padded block per candidate
+// hash takes lanes candidates of CAND_STRIDE characters, back to back
+struct Sha256Kernel {
+    const char* name;
+    int lanes;
+    int (*supported)();
+    int (*hash)(const char* in, uint64_t* out);
+};
 
 
-// Hash Table Struct
-typedef struct HashNode {
-    char str[BUFF_SIZE + 1];
-    unsigned char hash[HASH_LENGTH];
-    struct HashNode* next;
-} HashNode;
+// Distinguished point table slot
+// key is the point plus one, 0 while empty. start and length are
+// written by the thread that claimed the key, then ready is set
+typedef struct DpSlot {
+    _Atomic uint64_t key;
+    uint64_t start;
+    long long length;
+    atomic_int ready;
+} DpSlot;
 
 
+// Distinguished point worker
+// Walks chains from random starts and publishes their end points
+typedef struct DpWorker {
+    pthread_t thread;
+    int running;
+    uint64_t seed;
+    int dp_shift;
+    long long max_chain;
+    DpSlot* slots;
+    atomic_int* found;
+    atomic_llong* evals;
+} DpWorker;
+
+
+// Trial runner, jobs threads take trial numbers from next until trials run out
+// Each trial's weak search uses threads threads
+typedef struct TrialPool {
+    int trials;
+    int threads;
+    const char* mode;
+    atomic_int next;
+    long long* weak;
+    long long* strong;
+} TrialPool;
+
+
+// Job thread of the trial runner
+typedef struct TrialJob {
+    pthread_t thread;
+    int running;
+    uint64_t seed;
+    TrialPool* pool;
+} TrialJob;
+
+
+// Summary of the attempt counts of one search over all trials
+typedef struct TrialStats {
+    int count;
+    int failed;
+    double mean;
+    double stddev;
+    double median;
+    long long p10;
+    long long p90;
+    long long p99;
+    long long min;
+    long long max;
+} TrialStats;
+
+
+/******************************************************************************
+ * Name: seed_random
+ * Description:
+ *     Seeds the calling thread's random generator.
+ * Parameters:
+ *     - seed: Any 64-bit value, expanded with splitmix64
+******************************************************************************/
+void seed_random(uint64_t seed);
+
+/******************************************************************************
+ * Name: random_u64
+ * Description:
+ *     Next value of the calling thread's xoshiro256** generator.
+ * Parameters:
+ *     - None
+******************************************************************************/
+uint64_t random_u64();
+
 /******************************************************************************
  * Name: generate_char
  * Description:
- *     Generates a random character.
+ *     Generates a random character from the thread's generator.
  * Parameters:
  *     - None
 ******************************************************************************/
@@ -41,31 +209,179 @@ char generate_char();
 ******************************************************************************/
 void generate_string(char *str, size_t length);
 
+/******************************************************************************
+ * Name: decode_candidate
+ * Description:
+ *     Writes the candidate string with the given index, base 27 digits.
+ *     One to one for indexes below 27^cand_len.
+ * Parameters:
+ *     - index: Candidate number
+ *     - str: Buffer of CAND_STRIDE characters
+******************************************************************************/
+void decode_candidate(uint64_t index, char *str);
+
+/******************************************************************************
+ * Name: candidate_space
+ * Description:
+ *     Number of candidate indexes, 27^cand_len capped to fit a table slot
+ * Parameters:
+ *     - None
+******************************************************************************/
+uint64_t candidate_space();
+
+/******************************************************************************
+ * Name: odometer_set
+ * Description:
+ *     Moves the odometer to the candidate with the given index
+ * Parameters:
+ *     - od: Odometer to set
+ *     - index: Candidate number
+******************************************************************************/
+void odometer_set(Odometer *od, uint64_t index);
+
+/******************************************************************************
+ * Name: odometer_next
+ * Description:
+ *     Steps the odometer to the next candidate, usually one character
+ * Parameters:
+ *     - od: Odometer to step
+******************************************************************************/
+void odometer_next(Odometer *od);
+
+/******************************************************************************
+ * Name: evp_digest
+ * Description:
+ *     Hashes the input with an OpenSSL digest, truncated to hash_bits.
+ * Parameters:
+ *     - digest: OpenSSL digest
+ *     - input: String to hash
+ *     - hash: The output hash
+******************************************************************************/
+int evp_digest(const EVP_MD *digest, const char *input, uint64_t *hash);
+
 /******************************************************************************
  * Name: digest_data
  * Description:
- *     Hashes the input using SHA-256 and truncates the result to 24 bits.
+ *     Hashes the input using SHA-256 and truncates the result to hash_bits.
  * Parameters:
  *     - input: String to hash
  *     - hash: The output hash
 ******************************************************************************/
-int digest_data(const char *input, unsigned char *hash);
+int digest_data(const char *input, uint64_t *hash);
+
+/******************************************************************************
+ * Name: select_kernel
+ * Description:
+ *     Picks the SHA-256 kernel used by sha256_batch, for the current
+ *     cand_len and hash_bits. Returns 0 if it is unknown, unsupported or disagrees with OpenSSL
+ * Parameters:
+ *     - name: Kernel name, or "auto" for the fastest working one
+******************************************************************************/
+int select_kernel(const char* name);
+
+/******************************************************************************
+ * Name: kernel_name
+ * Description:
+ *     Name of the selected batch kernel
+ * Parameters:
+ *     - None
+******************************************************************************/
+const char* kernel_name();
+
+/******************************************************************************
+ * Name: sha256_batch
+ * Description:
+ *     Hashes count candidates with the selected kernel, truncated like
+ *     digest_data. Falls back to the one lane kernel for a short tail
+ * Parameters:
+ *     - strs: count strings of CAND_STRIDE characters, back to back
+ *     - count: Number of candidates
+ *     - hashes: count truncated hashes
+******************************************************************************/
+int sha256_batch(const char* strs, int count, uint64_t* hashes);
+
+/******************************************************************************
+ * Name: backend_count
+ * Description:
+ *     Number of backends, for listing them with backend_at
+ * Parameters:
+ *     - None
+******************************************************************************/
+int backend_count();
+
+/******************************************************************************
+ * Name: backend_at
+ * Description:
+ *     Name of backend i
+ * Parameters:
+ *     - i: Index below backend_count
+******************************************************************************/
+const char* backend_at(int i);
+
+/******************************************************************************
+ * Name: select_backend
+ * Description:
+ *     Picks the hash behind digest_batch. Returns 0 if it is unknown,
+ *     missing from OpenSSL or fails its known answers
+ * Parameters:
+ *     - name: Backend name
+******************************************************************************/
+int select_backend(const char* name);
+
+/******************************************************************************
+ * Name: backend_name
+ * Description:
+ *     Name of the selected backend
+ * Parameters:
+ *     - None
+******************************************************************************/
+const char* backend_name();
+
+/******************************************************************************
+ * Name: free_backend
+ * Description:
+ *     Releases the selected backend's OpenSSL digest
+ * Parameters:
+ *     - None
+******************************************************************************/
+void free_backend();
+
+/******************************************************************************
+ * Name: digest_batch
+ * Description:
+ *     Hashes count candidates with the selected backend, truncated to
+ *     hash_bits. SHA-256 until a backend is selected
+ * Parameters:
+ *     - strs: count strings of CAND_STRIDE characters, back to back
+ *     - count: Number of candidates
+ *     - hashes: count truncated hashes
+******************************************************************************/
+int digest_batch(const char* strs, int count, uint64_t* hashes);
+
+/******************************************************************************
+ * Name: free_digest
+ * Description:
+ *     Frees the calling thread's digest context.
+ * Parameters:
+ *     - None
+******************************************************************************/
+void free_digest();
 
 
 /******************************************************************************
  * Name: hash_key
  * Description:
- *     Turns hash to key in dic
+ *     Turns hash to key in dic, its top TABLE_BITS bits
  * Parameters:
  *     - hash: hash value
 ******************************************************************************/
-unsigned int hash_key(const unsigned char *hash);
+unsigned int hash_key(uint64_t hash);
 
 
 /******************************************************************************
  * Name: free_table
  * Description:
- *     Frees data
+ *     Frees the strong collision table
  * Parameters:
  *     - None
 ******************************************************************************/
@@ -75,20 +391,70 @@ void free_table();
 /******************************************************************************
  * Name: weak_trial
  * Description:
- *     Brute forces a weak collision
+ *     Brute forces a weak collision on every thread
+ *     Returns the attempt count of the first hit in the interleaved stream
  * Parameters:
- *     - None
+ *     - threads: Number of worker threads
 ******************************************************************************/
-int weak_trial();
+long long weak_trial(int threads);
 
 
 /******************************************************************************
  * Name: strong_trial
  * Description:
- *     Brute forces a strong collision
+ *     Brute forces a strong collision with a direct addressed table
+ *     The table is allocated once, later trials only bump its generation
  * Parameters:
  *     - None
 ******************************************************************************/
-int strong_trial();
+long long strong_trial();
+
+/******************************************************************************
+ * Name: rho_trial
+ * Description:
+ *     Finds a strong collision with Brent's cycle finding in O(1) memory
+ *     Walks x -> hash(candidate x) over the truncated hash space
+ *     Returns the number of hashes computed
+ * Parameters:
+ *     - None
+******************************************************************************/
+long long rho_trial();
+
+/******************************************************************************
+ * Name: dp_trial
+ * Description:
+ *     Finds a strong collision with parallel distinguished points
+ *     Each thread walks its own chains, two chains ending in the same
+ *     distinguished point are walked again to the point where they merge
+ *     Returns the number of hashes computed over all threads
+ * Parameters:
+ *     - threads: Number of worker threads
+******************************************************************************/
+long long dp_trial(int threads);
+
+/******************************************************************************
+ * Name: run_trials
+ * Description:
+ *     Runs trials of both searches concurrently on jobs threads and prints
+ *     their statistics. Returns 0 if any trial failed
+ * Parameters:
+ *     - trials: Number of trials
+ *     - jobs: Trials run at once
+ *     - threads: Threads to split between the jobs
+ *     - mode: Strong search, table, rho or dp
+ *     - format: human, csv or json
+******************************************************************************/
+int run_trials(int trials, int jobs, int threads, const char* mode, const char* format);
+
+/******************************************************************************
+ * Name: run_benchmark
+ * Description:
+ *     Prints hashes per second of every backend at 1, 2, 4, ... threads
+ * Parameters:
+ *     - threads: Most threads to try
+ *     - seconds: Time per measurement
+ *     - format: human, csv or json
+******************************************************************************/
+void run_benchmark(int threads, double seconds, const char* format);
 
 #endif 
@@ -1,94 +1,1131 @@
-#ifndef CONFIGS_H
-#define CONFIGS_H
+#include "configs.h"
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <time.h>
-#include <unistd.h>     
-#include <openssl/evp.h>
+// Digest algorithm, fetched once in main
+static EVP_MD* md = NULL;
 
-#define HASH_LENGTH     3
-#define BUFF_SIZE       8
-#define BUCKETS         16777216
-#define MAX_ATTEMPTS    9999999999
+// Digest context, one per thread and reused for every hash
+static __thread EVP_MD_CTX* md_ctx = NULL;
 
+// Strong collision table, BUCKETS slots and the generation of the current trial
+// One per thread so that concurrent trials each have their own
+static __thread uint64_t* table = NULL;
+static __thread uint64_t table_gen = 0;
 
-// Hash Table Struct
-typedef struct HashNode {
-    char str[BUFF_SIZE + 1];
-    unsigned char hash[HASH_LENGTH];
-    struct HashNode* next;
-} HashNode;
+// Random generator state, one stream per thread
+static __thread uint64_t rng[4];
+
+// Candidates come from a counter over the candidate space, or at random
+static int counter_candidates = 1;
+
+// Runtime widths, see configs.h
+int hash_bits = HASH_LENGTH * 8;
+int cand_len = BUFF_SIZE;
+
+
+/******************************************************************************
+ * Name: seed_random
+ * Description:
+ *     Seeds the calling thread's random generator.
+ * Parameters:
+ *     - seed: Any 64-bit value, expanded with splitmix64
+******************************************************************************/
+void seed_random(uint64_t seed) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        rng[i] = z ^ (z >> 31);
+    }
+}
+
+
+/******************************************************************************
+ * Name: random_u64
+ * Description:
+ *     Next value of the calling thread's xoshiro256** generator.
+ * Parameters:
+ *     - None
+******************************************************************************/
+uint64_t random_u64() {
+    uint64_t result = rng[1] * 5;
+    result = ((result << 7) | (result >> 57)) * 9;
+
+    uint64_t t = rng[1] << 17;
+    rng[2] ^= rng[0];
+    rng[3] ^= rng[1];
+    rng[1] ^= rng[2];
+    rng[0] ^= rng[3];
+    rng[2] ^= t;
+    rng[3] = (rng[3] << 45) | (rng[3] >> 19);
+    return result;
+}
 
 
 /******************************************************************************
  * Name: generate_char
  * Description:
- *     Generates a random character.
+ *     Generates a random character from the thread's generator.
  * Parameters:
  *     - None
 ******************************************************************************/
-char generate_char();
+char generate_char() {
+    // Top 32 bits scaled onto the alphabet, no modulo bias worth noting
+    return ALPHABET[((random_u64() >> 32) * ALPHABET_SIZE) >> 32];
+}
+
 
 /******************************************************************************
  * Name: generate_string
  * Description:
  *     Fills a buffer with a random string of uppercase characters and spaces.
  * Parameters:
- *     - str: Pointer to the character buffer 
+ *     - str: Pointer to the character buffer
  *     - length: Number of characters to generate
 ******************************************************************************/
-void generate_string(char *str, size_t length);
+void generate_string(char *str, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        str[i] = generate_char();
+    }
+    str[length] = '\0';
+}
+
+
+/******************************************************************************
+ * Name: decode_candidate
+ * Description:
+ *     Writes the candidate string with the given index, base 27 digits.
+ *     One to one for indexes below 27^cand_len.
+ * Parameters:
+ *     - index: Candidate number
+ *     - str: Buffer of CAND_STRIDE characters
+******************************************************************************/
+void decode_candidate(uint64_t index, char *str) {
+    int i;
+    for (i = 0; i < cand_len; i++) {
+        str[i] = ALPHABET[index % ALPHABET_SIZE];
+        index /= ALPHABET_SIZE;
+    }
+    str[cand_len] = '\0';
+}
+
+
+/******************************************************************************
+ * Name: candidate_space
+ * Description:
+ *     Number of candidate indexes, 27^cand_len capped to fit a table slot
+ * Parameters:
+ *     - None
+******************************************************************************/
+uint64_t candidate_space() {
+    uint64_t space = 1;
+    int i;
+    for (i = 0; i < cand_len && space <= SLOT_CAND_MASK / ALPHABET_SIZE; i++) {
+        space *= ALPHABET_SIZE;
+    }
+    return space;
+}
+
+
+/******************************************************************************
+ * Name: odometer_set
+ * Description:
+ *     Moves the odometer to the candidate with the given index
+ * Parameters:
+ *     - od: Odometer to set
+ *     - index: Candidate number
+******************************************************************************/
+void odometer_set(Odometer *od, uint64_t index) {
+    int i;
+    for (i = 0; i < cand_len; i++) {
+        od->digits[i] = index % ALPHABET_SIZE;
+        od->str[i] = ALPHABET[od->digits[i]];
+        index /= ALPHABET_SIZE;
+    }
+    od->str[cand_len] = '\0';
+}
+
+
+/******************************************************************************
+ * Name: odometer_next
+ * Description:
+ *     Steps the odometer to the next candidate, usually one character
+ * Parameters:
+ *     - od: Odometer to step
+******************************************************************************/
+void odometer_next(Odometer *od) {
+    int i;
+    for (i = 0; i < cand_len; i++) {
+        if (++od->digits[i] < ALPHABET_SIZE) {
+            od->str[i] = ALPHABET[od->digits[i]];
+            return;
+        }
+        od->digits[i] = 0;
+        od->str[i] = ALPHABET[0];
+    }
+}
+
+
+/******************************************************************************
+ * Name: evp_digest
+ * Description:
+ *     Hashes the input with an OpenSSL digest, truncated to hash_bits.
+ *     The thread's context is created on first use and reset by each init.
+ * Parameters:
+ *     - digest: OpenSSL digest
+ *     - input: String to hash
+ *     - hash: The output hash
+******************************************************************************/
+int evp_digest(const EVP_MD *digest, const char *input, uint64_t *hash) {
+    unsigned char full[EVP_MAX_MD_SIZE];
+    unsigned int len, i;
+
+    if (md_ctx == NULL && (md_ctx = EVP_MD_CTX_new()) == NULL) {
+        return 0;
+    }
+    if (!EVP_DigestInit_ex(md_ctx, digest, NULL) ||
+        !EVP_DigestUpdate(md_ctx, input, cand_len) ||
+        !EVP_DigestFinal_ex(md_ctx, full, &len)) {
+        return 0;
+    }
+
+    *hash = 0;
+    for (i = 0; i < 8; i++) {
+        *hash = (*hash << 8) | full[i];
+    }
+    *hash >>= 64 - hash_bits;
+    return 1;
+}
+
 
 /******************************************************************************
  * Name: digest_data
  * Description:
- *     Hashes the input using SHA-256 and truncates the result to 24 bits.
+ *     Hashes the input using SHA-256 and truncates the result to hash_bits.
+ *     The reference the SHA-256 kernels are checked against.
  * Parameters:
  *     - input: String to hash
  *     - hash: The output hash
 ******************************************************************************/
-int digest_data(const char *input, unsigned char *hash);
+int digest_data(const char *input, uint64_t *hash) {
+    return evp_digest(md, input, hash);
+}
+
+
+/******************************************************************************
+ * Name: free_digest
+ * Description:
+ *     Frees the calling thread's digest context.
+ * Parameters:
+ *     - None
+******************************************************************************/
+void free_digest() {
+    EVP_MD_CTX_free(md_ctx);
+    md_ctx = NULL;
+}
 
 
 /******************************************************************************
  * Name: hash_key
  * Description:
- *     Turns hash to key in dic
+ *     Turns hash to key in dic, its top TABLE_BITS bits
  * Parameters:
  *     - hash: hash value
 ******************************************************************************/
-unsigned int hash_key(const unsigned char *hash);
+unsigned int hash_key(uint64_t hash) {
+    return (unsigned int)(hash >> (hash_bits > TABLE_BITS ? hash_bits - TABLE_BITS : 0));
+}
 
 
 /******************************************************************************
  * Name: free_table
  * Description:
- *     Frees data
+ *     Frees the calling thread's strong collision table
  * Parameters:
  *     - None
 ******************************************************************************/
-void free_table();
+void free_table() {
+    free(table);
+    table = NULL;
+    table_gen = 0;
+}
+
+
+/******************************************************************************
+ * Name: weak_worker
+ * Description:
+ *     Searches this thread's share of the interleaved candidate stream
+ *     Candidate k of thread t is number k * T + t + 1 overall. A thread
+ *     stops once its next number passes the best hit, so the smallest hit
+ *     is exact no matter how the threads were scheduled.
+ * Parameters:
+ *     - arg: Pointer to the thread's WeakWorker
+******************************************************************************/
+static void* weak_worker(void* arg) {
+    WeakWorker* w = (WeakWorker*)arg;
+    Odometer od;
+    char strs[DIGEST_BATCH][CAND_STRIDE];
+    uint64_t hashes[DIGEST_BATCH];
+    long long n = w->id + 1;
+    long long best = atomic_load_explicit(w->best, memory_order_relaxed);
+
+    seed_random(w->seed);
+    odometer_set(&od, w->start);
+    while (n < best && n <= w->limit) {
+        int k, b;
+        for (k = 0; k < CHECK_BATCH && n < best && n <= w->limit; k += DIGEST_BATCH) {
+            for (b = 0; b < DIGEST_BATCH; b++) {
+                if (counter_candidates) {
+                    memcpy(strs[b], od.str, CAND_STRIDE);
+                    odometer_next(&od);
+                } else {
+                    generate_string(strs[b], cand_len);
+                }
+            }
+            if (!digest_batch(strs[0], DIGEST_BATCH, hashes)) {
+                n = w->limit + 1;
+                break;
+            }
+            for (b = 0; b < DIGEST_BATCH && n < best && n <= w->limit; b++, n += w->threads) {
+                if (hashes[b] == w->target && strcmp(strs[b], w->target_str) != 0) {
+                    // Lower the shared best to n unless a smaller hit got there first
+                    long long cur = atomic_load(w->best);
+                    while (n < cur && !atomic_compare_exchange_weak(w->best, &cur, n));
+                    break;
+                }
+            }
+        }
+        best = atomic_load_explicit(w->best, memory_order_relaxed);
+    }
+
+    free_digest();
+    return NULL;
+}
 
 
 /******************************************************************************
  * Name: weak_trial
  * Description:
- *     Brute forces a weak collision
+ *     Brute forces a weak collision on every thread
+ *     Returns the attempt count of the first hit in the interleaved stream
  * Parameters:
- *     - None
+ *     - threads: Number of worker threads
 ******************************************************************************/
-int weak_trial();
+long long weak_trial(int threads) {
+    char target_str[CAND_STRIDE];
+    uint64_t target;
+    atomic_llong best = LLONG_MAX;
+    uint64_t space = candidate_space();
+    uint64_t base = random_u64() % space;
+    long long limit = 1;
+    int t;
+
+    // Counter mode hashes each of the 27^len candidates once, after
+    // that the target has no other preimage and the trial fails
+    for (t = 0; t < cand_len && limit <= MAX_ATTEMPTS; t++) {
+        limit *= ALPHABET_SIZE;
+    }
+    if (!counter_candidates || limit > MAX_ATTEMPTS) {
+        limit = MAX_ATTEMPTS;
+    }
+
+    // Fixed target for this trial
+    generate_string(target_str, cand_len);
+    if (!digest_batch(target_str, 1, &target)) {
+        return -1;
+    }
+
+    WeakWorker* workers = (WeakWorker*)calloc(threads, sizeof(WeakWorker));
+    if (workers == NULL) {
+        return -1;
+    }
+    for (t = 0; t < threads; t++) {
+        workers[t].id = t;
+        workers[t].threads = threads;
+        workers[t].seed = random_u64();
+        // Counter mode gives each thread its own range from a random base
+        workers[t].start = (base + space / threads * t) % space;
+        workers[t].target_str = target_str;
+        workers[t].target = target;
+        workers[t].limit = limit;
+        workers[t].best = &best;
+        workers[t].running = pthread_create(&workers[t].thread, NULL, weak_worker, &workers[t]) == 0;
+        if (!workers[t].running) {
+            // Every share of the stream must be searched, do this one here
+            weak_worker(&workers[t]);
+        }
+    }
+    for (t = 0; t < threads; t++) {
+        if (workers[t].running) {
+            pthread_join(workers[t].thread, NULL);
+        }
+    }
+    free(workers);
+
+    long long found = atomic_load(&best);
+    return found == LLONG_MAX ? -1 : found;
+}
 
 
 /******************************************************************************
  * Name: strong_trial
  * Description:
- *     Brute forces a strong collision
+ *     Brute forces a strong collision with a direct addressed table
+ *     The table is allocated once, later trials only bump its generation
+ * Parameters:
+ *     - None
+******************************************************************************/
+long long strong_trial() {
+    uint64_t space = candidate_space();
+    uint64_t next = random_u64() % space;
+    Odometer od;
+    long long attempts;
+
+    if (table == NULL) {
+        table = (uint64_t*)calloc(BUCKETS, sizeof(uint64_t));
+        if (table == NULL) {
+            return -1;
+        }
+    }
+    if (++table_gen == SLOT_GEN_LIMIT) {
+        memset(table, 0, BUCKETS * sizeof(uint64_t));
+        table_gen = 1;
+    }
+
+    char strs[DIGEST_BATCH][CAND_STRIDE];
+    uint64_t hashes[DIGEST_BATCH];
+    uint64_t cands[DIGEST_BATCH];
+    int b = DIGEST_BATCH;
+
+    for (attempts = 1; attempts <= MAX_ATTEMPTS; attempts++, b++) {
+        if (b == DIGEST_BATCH) {
+            // Counter candidates from a random base, or random indexes
+            // scaled onto the space without a modulo
+            for (b = 0; b < DIGEST_BATCH; b++) {
+                if (counter_candidates) {
+                    if (next == space) {
+                        next = 0;
+                    }
+                    if (next == 0 || attempts + b == 1) {
+                        odometer_set(&od, next);
+                    }
+                    cands[b] = next++;
+                    memcpy(strs[b], od.str, CAND_STRIDE);
+                    odometer_next(&od);
+                } else {
+                    cands[b] = (uint64_t)(((unsigned __int128)random_u64() * space) >> 64);
+                    decode_candidate(cands[b], strs[b]);
+                }
+            }
+            if (!digest_batch(strs[0], DIGEST_BATCH, hashes)) {
+                return -1;
+            }
+            b = 0;
+        }
+        uint64_t cand = cands[b];
+        uint64_t hash = hashes[b];
+
+        // Up to TABLE_BITS the hash is the slot, wider hashes share slots
+        // and the stored candidate is hashed again to check it
+        uint64_t* slot = &table[hash_key(hash)];
+        if (*slot >> SLOT_CAND_BITS == table_gen && (*slot & SLOT_CAND_MASK) != cand) {
+            if (hash_bits <= TABLE_BITS) {
+                return attempts;
+            }
+            char seen_str[CAND_STRIDE];
+            uint64_t seen;
+            decode_candidate(*slot & SLOT_CAND_MASK, seen_str);
+            if (digest_batch(seen_str, 1, &seen) && seen == hash) {
+                return attempts;
+            }
+        }
+        *slot = table_gen << SLOT_CAND_BITS | cand;
+    }
+    return -1;
+}
+
+
+/******************************************************************************
+ * Name: rho_step
+ * Description:
+ *     One step of the rho walk, the truncated hash of candidate x
+ * Parameters:
+ *     - x: Current point, a truncated hash as an integer
+******************************************************************************/
+static uint64_t rho_step(uint64_t x) {
+    char str[CAND_STRIDE];
+    uint64_t next = 0;
+
+    decode_candidate(x, str);
+    digest_batch(str, 1, &next);
+    return next;
+}
+
+
+// Truncated hash space, every rho and dp point is below this mask
+#define POINT_MASK (UINT64_MAX >> (64 - hash_bits))
+
+
+/******************************************************************************
+ * Name: rho_trial
+ * Description:
+ *     Finds a strong collision with Brent's cycle finding in O(1) memory
+ *     Walks x -> hash(candidate x) over the truncated hash space
+ *     Returns the number of hashes computed
  * Parameters:
  *     - None
 ******************************************************************************/
-int strong_trial();
+long long rho_trial() {
+    long long evals = 0;
+
+    while (evals <= MAX_ATTEMPTS) {
+        uint64_t start = random_u64() & POINT_MASK;
+
+        // Brent: grow a window in powers of two until the hare meets the tortoise
+        uint64_t tortoise = start, hare = rho_step(start);
+        long long power = 1, lam = 1, i;
+        evals++;
+        while (tortoise != hare && evals <= MAX_ATTEMPTS) {
+            if (power == lam) {
+                tortoise = hare;
+                power *= 2;
+                lam = 0;
+            }
+            hare = rho_step(hare);
+            evals++;
+            lam++;
+        }
+
+        // Put the hare lam steps ahead, then walk both to the cycle entry
+        tortoise = hare = start;
+        for (i = 0; i < lam; i++) {
+            hare = rho_step(hare);
+        }
+        evals += lam;
+
+        // The points just before the meeting are two preimages of it
+        uint64_t prev_t = tortoise, prev_h = hare;
+        while (tortoise != hare) {
+            prev_t = tortoise;
+            prev_h = hare;
+            tortoise = rho_step(tortoise);
+            hare = rho_step(hare);
+            evals += 2;
+        }
+
+        // Start was on the cycle, or the two candidates are the same text
+        char a[CAND_STRIDE], b[CAND_STRIDE];
+        decode_candidate(prev_t, a);
+        decode_candidate(prev_h, b);
+        if (prev_t != prev_h && strcmp(a, b) != 0) {
+            return evals;
+        }
+    }
+    return -1;
+}
+
+
+/******************************************************************************
+ * Name: dp_resolve
+ * Description:
+ *     Walks two chains that end in the same distinguished point until they
+ *     merge. Returns 1 with the two preimages in a and b, 0 when one start
+ *     lies on the other chain or the preimages are the same text
+ * Parameters:
+ *     - a, la: First chain start and length, the first preimage on return
+ *     - b, lb: Second chain start and length, the second preimage on return
+ *     - evals: Hashes computed, added to
+******************************************************************************/
+static int dp_resolve(uint64_t* a, long long la, uint64_t* b, long long lb, long long* evals) {
+    uint64_t x = *a, y = *b;
+
+    // Line the chains up at the same distance from the end
+    for (; la > lb; la--, (*evals)++) {
+        x = rho_step(x);
+    }
+    for (; lb > la; lb--, (*evals)++) {
+        y = rho_step(y);
+    }
+    if (x == y) {
+        return 0;
+    }
+
+    for (;;) {
+        uint64_t nx = rho_step(x), ny = rho_step(y);
+        *evals += 2;
+        if (nx == ny) {
+            char sx[CAND_STRIDE], sy[CAND_STRIDE];
+            decode_candidate(x, sx);
+            decode_candidate(y, sy);
+            *a = x;
+            *b = y;
+            return strcmp(sx, sy) != 0;
+        }
+        x = nx;
+        y = ny;
+    }
+}
+
+
+/******************************************************************************
+ * Name: dp_publish
+ * Description:
+ *     Stores a chain under its distinguished point. Returns the slot of an
+ *     earlier chain with the same end, or NULL if this one was stored
+ * Parameters:
+ *     - slots: DP_SLOTS shared slots
+ *     - point: Distinguished point the chain ended in
+ *     - start, length: The chain
+******************************************************************************/
+static DpSlot* dp_publish(DpSlot* slots, uint64_t point, uint64_t start, long long length) {
+    uint64_t key = point + 1;
+    size_t i = (size_t)((point * 0x9E3779B97F4A7C15ULL) >> 48) & (DP_SLOTS - 1);
+    size_t probes;
+
+    // Linear probing, a full table just drops the chain
+    for (probes = 0; probes < DP_SLOTS; probes++, i = (i + 1) & (DP_SLOTS - 1)) {
+        uint64_t cur = 0;
+        if (atomic_compare_exchange_strong(&slots[i].key, &cur, key)) {
+            slots[i].start = start;
+            slots[i].length = length;
+            atomic_store_explicit(&slots[i].ready, 1, memory_order_release);
+            return NULL;
+        }
+        if (cur == key) {
+            // Claimed, wait for the owner to finish writing it
+            while (!atomic_load_explicit(&slots[i].ready, memory_order_acquire));
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Name: dp_worker
+ * Description:
+ *     Thread body of dp_trial, walks chains until any thread finds a collision
+ * Parameters:
+ *     - arg: Pointer to the thread's DpWorker
+******************************************************************************/
+static void* dp_worker(void* arg) {
+    DpWorker* w = (DpWorker*)arg;
+    long long evals = 0;
+
+    seed_random(w->seed);
+    while (!atomic_load_explicit(w->found, memory_order_relaxed)) {
+        uint64_t start = random_u64() & POINT_MASK;
+        uint64_t x = start;
+        long long length = 0;
+
+        // Walk to a distinguished point, chains stuck in a short cycle are dropped
+        do {
+            x = rho_step(x);
+            length++;
+        } while (x >> w->dp_shift != 0 && length < w->max_chain);
+        evals += length;
+
+        DpSlot* slot = NULL;
+        if (length < w->max_chain) {
+            slot = dp_publish(w->slots, x, start, length);
+        }
+        if (slot != NULL && slot->start != start) {
+            uint64_t a = slot->start, b = start;
+            int none = 0;
+            if (dp_resolve(&a, slot->length, &b, length, &evals)) {
+                atomic_compare_exchange_strong(w->found, &none, 1);
+            }
+        }
+
+        // Hand over the count once per chain so the total can be capped
+        if (atomic_fetch_add(w->evals, evals) + evals > MAX_ATTEMPTS) {
+            int none = 0;
+            atomic_compare_exchange_strong(w->found, &none, -1);
+        }
+        evals = 0;
+    }
+
+    free_digest();
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Name: dp_trial
+ * Description:
+ *     Finds a strong collision with parallel distinguished points
+ *     Each thread walks its own chains, two chains ending in the same
+ *     distinguished point are walked again to the point where they merge
+ *     Returns the number of hashes computed over all threads
+ * Parameters:
+ *     - threads: Number of worker threads
+******************************************************************************/
+long long dp_trial(int threads) {
+    atomic_int found = 0;
+    atomic_llong evals = 0;
+    int dp_bits = hash_bits / 2 > 10 ? hash_bits / 2 - 10 : 0;
+    int t;
+
+    DpSlot* slots = (DpSlot*)calloc(DP_SLOTS, sizeof(DpSlot));
+    DpWorker* workers = (DpWorker*)calloc(threads, sizeof(DpWorker));
+    if (slots == NULL || workers == NULL) {
+        free(slots);
+        free(workers);
+        return -1;
+    }
+    for (t = 0; t < threads; t++) {
+        workers[t].seed = random_u64();
+        // Points are distinguished by dp_bits zero top bits
+        workers[t].dp_shift = hash_bits - dp_bits;
+        workers[t].max_chain = (long long)DP_MAX_CHAIN << dp_bits;
+        workers[t].slots = slots;
+        workers[t].found = &found;
+        workers[t].evals = &evals;
+        workers[t].running = pthread_create(&workers[t].thread, NULL, dp_worker, &workers[t]) == 0;
+    }
+
+    // Any thread can find the collision alone, only run inline if none started
+    for (t = 0; t < threads && !workers[t].running; t++);
+    if (t == threads) {
+        dp_worker(&workers[0]);
+    }
+    for (t = 0; t < threads; t++) {
+        if (workers[t].running) {
+            pthread_join(workers[t].thread, NULL);
+        }
+    }
+    free(workers);
+    free(slots);
+
+    return atomic_load(&found) == 1 ? atomic_load(&evals) : -1;
+}
+
+
+/******************************************************************************
+ * Name: strong_search
+ * Description:
+ *     Runs one strong trial with the named search
+ * Parameters:
+ *     - mode: table, rho or dp
+ *     - threads: Threads for dp
+******************************************************************************/
+static long long strong_search(const char* mode, int threads) {
+    if (strcmp(mode, "dp") == 0) {
+        return dp_trial(threads);
+    }
+    if (strcmp(mode, "rho") == 0) {
+        return rho_trial();
+    }
+    return strong_trial();
+}
+
+
+/******************************************************************************
+ * Name: trial_job
+ * Description:
+ *     Thread body of run_trials, runs trials until none are left
+ * Parameters:
+ *     - arg: Pointer to the thread's TrialJob
+******************************************************************************/
+static void* trial_job(void* arg) {
+    TrialJob* job = (TrialJob*)arg;
+    TrialPool* pool = job->pool;
+    int i;
+
+    seed_random(job->seed);
+    while ((i = atomic_fetch_add(&pool->next, 1)) < pool->trials) {
+        pool->weak[i] = weak_trial(pool->threads);
+        pool->strong[i] = strong_search(pool->mode, pool->threads);
+    }
+
+    free_table();
+    free_digest();
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Name: compare_counts
+ * Description:
+ *     qsort order for attempt counts
+ * Parameters:
+ *     - a, b: Pointers to two long longs
+******************************************************************************/
+static int compare_counts(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+
+/******************************************************************************
+ * Name: summarize
+ * Description:
+ *     Statistics of one search's counts, failed trials (-1) left out
+ *     Sorts counts in place
+ * Parameters:
+ *     - counts: One count per trial
+ *     - trials: Number of trials
+******************************************************************************/
+static TrialStats summarize(long long* counts, int trials) {
+    TrialStats st;
+    double sum = 0, sq = 0;
+    int i, n = 0;
+
+    memset(&st, 0, sizeof(st));
+    qsort(counts, trials, sizeof(long long), compare_counts);
+    while (n < trials && counts[n] < 0) {
+        n++;
+    }
+    st.failed = n;
+    counts += n;
+    st.count = n = trials - n;
+    if (n == 0) {
+        return st;
+    }
+
+    for (i = 0; i < n; i++) {
+        sum += counts[i];
+    }
+    st.mean = sum / n;
+    for (i = 0; i < n; i++) {
+        sq += (counts[i] - st.mean) * (counts[i] - st.mean);
+    }
+    st.stddev = n > 1 ? sqrt(sq / (n - 1)) : 0;
+    st.median = n % 2 ? counts[n / 2] : (counts[n / 2 - 1] + counts[n / 2]) / 2.0;
+
+    // Nearest rank percentiles
+    st.p10 = counts[(n * 10 + 99) / 100 - 1];
+    st.p90 = counts[(n * 90 + 99) / 100 - 1];
+    st.p99 = counts[(n * 99 + 99) / 100 - 1];
+    st.min = counts[0];
+    st.max = counts[n - 1];
+    return st;
+}
+
+
+/******************************************************************************
+ * Name: print_stats
+ * Description:
+ *     Prints one search's statistics and its ratio to 2^bound_bits
+ * Parameters:
+ *     - name: weak or strong
+ *     - st: The statistics
+ *     - bound_bits: Exponent of the theoretical bound, may be a half
+ *     - format: human, csv or json
+******************************************************************************/
+static void print_stats(const char* name, const TrialStats* st, double bound_bits, const char* format) {
+    double ratio = st->mean / pow(2, bound_bits);
+
+    if (strcmp(format, "csv") == 0) {
+        printf("%s,%d,%d,%d,%d,%.1f,%.1f,%.1f,%lld,%lld,%lld,%lld,%lld,%g,%.4f\n",
+               name, hash_bits, cand_len, st->count, st->failed, st->mean, st->stddev, st->median,
+               st->p10, st->p90, st->p99, st->min, st->max, bound_bits, ratio);
+    } else if (strcmp(format, "json") == 0) {
+        printf("{\"search\": \"%s\", \"bits\": %d, \"length\": %d, \"trials\": %d, \"failed\": %d, "
+               "\"mean\": %.1f, \"stddev\": %.1f, \"median\": %.1f, \"p10\": %lld, \"p90\": %lld, "
+               "\"p99\": %lld, \"min\": %lld, \"max\": %lld, \"bound_bits\": %g, \"ratio\": %.4f}\n",
+               name, hash_bits, cand_len, st->count, st->failed, st->mean, st->stddev, st->median,
+               st->p10, st->p90, st->p99, st->min, st->max, bound_bits, ratio);
+    } else {
+        printf("%-8s %14.1f %14.1f %14.1f %12lld %12lld %12lld   2^%-5g %.4f\n",
+               name, st->mean, st->stddev, st->median, st->p10, st->p90, st->p99, bound_bits, ratio);
+    }
+}
+
+
+/******************************************************************************
+ * Name: run_trials
+ * Description:
+ *     Runs trials of both searches concurrently on jobs threads and prints
+ *     their statistics. Returns 0 if any trial failed
+ * Parameters:
+ *     - trials: Number of trials
+ *     - jobs: Trials run at once
+ *     - threads: Threads to split between the jobs
+ *     - mode: Strong search, table, rho or dp
+ *     - format: human, csv or json
+******************************************************************************/
+int run_trials(int trials, int jobs, int threads, const char* mode, const char* format) {
+    TrialPool pool;
+    struct timespec start, end;
+    int j;
+
+    if (jobs > trials) {
+        jobs = trials;
+    }
+    pool.trials = trials;
+    pool.threads = threads / jobs > 1 ? threads / jobs : 1;
+    pool.mode = mode;
+    atomic_init(&pool.next, 0);
+    pool.weak = (long long*)calloc(trials, sizeof(long long));
+    pool.strong = (long long*)calloc(trials, sizeof(long long));
+    TrialJob* js = (TrialJob*)calloc(jobs, sizeof(TrialJob));
+    if (pool.weak == NULL || pool.strong == NULL || js == NULL) {
+        free(pool.weak);
+        free(pool.strong);
+        free(js);
+        return 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (j = 0; j < jobs; j++) {
+        js[j].seed = random_u64();
+        js[j].pool = &pool;
+        js[j].running = pthread_create(&js[j].thread, NULL, trial_job, &js[j]) == 0;
+    }
+
+    // Any job can run every trial, only run inline if none started
+    for (j = 0; j < jobs && !js[j].running; j++);
+    if (j == jobs) {
+        trial_job(&js[0]);
+    }
+    for (j = 0; j < jobs; j++) {
+        if (js[j].running) {
+            pthread_join(js[j].thread, NULL);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    TrialStats weak = summarize(pool.weak, trials);
+    TrialStats strong = summarize(pool.strong, trials);
+
+    if (strcmp(format, "csv") == 0) {
+        printf("search,bits,length,trials,failed,mean,stddev,median,p10,p90,p99,min,max,bound_bits,ratio\n");
+    } else if (strcmp(format, "human") == 0) {
+        printf("%d-bit %s, %d characters, %s kernel, %d trials, %d jobs x %d threads, %.2f s\n\n",
+               hash_bits, backend_name(), cand_len, kernel_name(), trials, jobs, pool.threads,
+               (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        printf("%-8s %14s %14s %14s %12s %12s %12s   %-7s %s\n",
+               "search", "mean", "stddev", "median", "p10", "p90", "p99", "bound", "ratio");
+    }
+    print_stats("weak", &weak, hash_bits, format);
+    print_stats(strcmp(mode, "table") == 0 ? "strong" : mode, &strong, hash_bits / 2.0, format);
+    if (strcmp(format, "human") == 0) {
+        printf("\nExpected ratios: weak 1, strong sqrt(pi / 2) = 1.2533\n");
+    }
+
+    free(pool.weak);
+    free(pool.strong);
+    free(js);
+    return weak.failed == 0 && strong.failed == 0;
+}
+
+
+/******************************************************************************
+ * Name: bench_worker
+ * Description:
+ *     Thread body of run_benchmark, hashes counter candidates in batches
+ *     until its time is up
+ * Parameters:
+ *     - arg: Pointer to the thread's BenchWorker
+******************************************************************************/
+static void* bench_worker(void* arg) {
+    BenchWorker* w = (BenchWorker*)arg;
+    char strs[DIGEST_BATCH][CAND_STRIDE];
+    uint64_t hashes[DIGEST_BATCH];
+    struct timespec start, now;
+    Odometer od;
+    int b, k;
+
+    odometer_set(&od, w->start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        for (k = 0; k < 64; k++) {
+            for (b = 0; b < DIGEST_BATCH; b++) {
+                memcpy(strs[b], od.str, CAND_STRIDE);
+                odometer_next(&od);
+            }
+            if (!digest_batch(strs[0], DIGEST_BATCH, hashes)) {
+                free_digest();
+                return NULL;
+            }
+            w->hashes += DIGEST_BATCH;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9 >= w->seconds) {
+            break;
+        }
+    }
+
+    free_digest();
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Name: run_benchmark
+ * Description:
+ *     Prints hashes per second of every backend at 1, 2, 4, ... threads
+ * Parameters:
+ *     - threads: Most threads to try
+ *     - seconds: Time per measurement
+ *     - format: human, csv or json
+******************************************************************************/
+void run_benchmark(int threads, double seconds, const char* format) {
+    BenchWorker* workers = (BenchWorker*)calloc(threads, sizeof(BenchWorker));
+    int i, n, t;
+
+    if (workers == NULL) {
+        return;
+    }
+    if (strcmp(format, "csv") == 0) {
+        printf("backend,bits,length,threads,hashes_per_sec,per_thread\n");
+    } else if (strcmp(format, "human") == 0) {
+        printf("%d-bit hashes of %d characters, %.2f s per run, %s kernel for sha256\n\n",
+               hash_bits, cand_len, seconds, kernel_name());
+        printf("%-12s %8s %14s %14s\n", "backend", "threads", "Mhash/s", "per thread");
+    }
+
+    for (i = 0; i < backend_count(); i++) {
+        if (!select_backend(backend_at(i))) {
+            if (strcmp(format, "human") == 0) {
+                printf("%-12s %8s\n", backend_at(i), "n/a");
+            }
+            continue;
+        }
+
+        // 1, 2, 4, ... threads, then all of them
+        for (n = 1; n <= threads; n = n == threads ? threads + 1 : (n * 2 > threads ? threads : n * 2)) {
+            long long total = 0;
+            for (t = 0; t < n; t++) {
+                workers[t].start = random_u64() % candidate_space();
+                workers[t].seconds = seconds;
+                workers[t].hashes = 0;
+                workers[t].running = pthread_create(&workers[t].thread, NULL, bench_worker, &workers[t]) == 0;
+            }
+            for (t = 0; t < n; t++) {
+                if (workers[t].running) {
+                    pthread_join(workers[t].thread, NULL);
+                    total += workers[t].hashes;
+                }
+            }
+
+            double rate = total / seconds;
+            if (strcmp(format, "csv") == 0) {
+                printf("%s,%d,%d,%d,%.0f,%.0f\n", backend_at(i), hash_bits, cand_len, n, rate, rate / n);
+            } else if (strcmp(format, "json") == 0) {
+                printf("{\"backend\": \"%s\", \"bits\": %d, \"length\": %d, \"threads\": %d, "
+                       "\"hashes_per_sec\": %.0f, \"per_thread\": %.0f}\n",
+                       backend_at(i), hash_bits, cand_len, n, rate, rate / n);
+            } else {
+                printf("%-12s %8d %14.2f %14.2f\n", backend_at(i), n, rate / 1e6, rate / n / 1e6);
+            }
+        }
+    }
+    free(workers);
+}
+
+
+int main(int argc, char* argv[]) {
+    seed_random((uint64_t)time(NULL) << 20 ^ getpid());
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) {
+        threads = 1;
+    }
+
+    md = EVP_MD_fetch(NULL, "SHA256", NULL);
+    if (md == NULL) {
+        fprintf(stderr, "SHA256 unavailable\n");
+        return 1;
+    }
+
+    // --strong table|rho|dp picks the strong search, the table is for narrow hashes
+    // --kernel auto|avx512|avx2|shani|openssl picks the SHA-256 kernel
+    // --candidates counter|random picks how candidates are made
+    // --bits and --length set the hash width and candidate length
+    // --trials N --jobs J --format human|csv|json runs many trials at once
+    // --hash picks the hash backend, --benchmark SECONDS times all of them
+    const char* mode = NULL;
+    const char* kernel = "auto";
+    const char* format = "human";
+    const char* hash = "sha256";
+    double bench = 0;
+    int trials = 0, jobs = threads;
+    int i;
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--hash") == 0) {
+            hash = argv[i + 1];
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            bench = atof(argv[i + 1]);
+        } else if (strcmp(argv[i], "--trials") == 0) {
+            trials = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            jobs = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--format") == 0) {
+            format = argv[i + 1];
+        } else if (strcmp(argv[i], "--bits") == 0) {
+            hash_bits = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--length") == 0) {
+            cand_len = atoi(argv[i + 1]);
+        } else if (strcmp(argv[i], "--strong") == 0) {
+            mode = argv[i + 1];
+        } else if (strcmp(argv[i], "--kernel") == 0) {
+            kernel = argv[i + 1];
+        } else if (strcmp(argv[i], "--candidates") == 0 && strcmp(argv[i + 1], "counter") == 0) {
+            counter_candidates = 1;
+        } else if (strcmp(argv[i], "--candidates") == 0 && strcmp(argv[i + 1], "random") == 0) {
+            counter_candidates = 0;
+        } else {
+            break;
+        }
+    }
+    if (mode == NULL) {
+        mode = hash_bits <= TABLE_BITS ? "table" : "dp";
+    }
+    if (i != argc || hash_bits < 1 || hash_bits > MAX_BITS || cand_len < 1 || cand_len > MAX_BUFF ||
+        trials < 0 || jobs < 1 || bench < 0 ||
+        (strcmp(mode, "table") != 0 && strcmp(mode, "rho") != 0 && strcmp(mode, "dp") != 0) ||
+        (strcmp(format, "human") != 0 && strcmp(format, "csv") != 0 && strcmp(format, "json") != 0)) {
+        fprintf(stderr, "usage: %s [--bits 1-%d] [--length 1-%d] [--strong table|rho|dp]\n"
+                "       [--hash NAME] [--kernel auto|avx512|avx2|shani|openssl] [--candidates counter|random]\n"
+                "       [--trials N [--jobs J] [--format human|csv|json]]\n"
+                "       [--benchmark SECONDS [--format human|csv|json]]\n"
+                "hashes:", argv[0], MAX_BITS, MAX_BUFF);
+        for (i = 0; i < backend_count(); i++) {
+            fprintf(stderr, " %s", backend_at(i));
+        }
+        fprintf(stderr, "\n");
+        return 1;
+    }
+
+    // The searches need many candidates per hash value, 27^len >= 2^(bits + 4),
+    // or a weak target often has no other preimage at all
+    if (cand_len * 4.7549 < hash_bits + 4) {
+        fprintf(stderr, "%d characters give fewer than 2^%d candidates\n", cand_len, hash_bits + 4);
+        return 1;
+    }
+    if (!select_kernel(kernel)) {
+        fprintf(stderr, "SHA-256 kernel %s unavailable\n", kernel);
+        return 1;
+    }
+    if (bench > 0) {
+        run_benchmark(threads, bench, format);
+        free_backend();
+        EVP_MD_free(md);
+        return 0;
+    }
+    if (!select_backend(hash)) {
+        fprintf(stderr, "hash %s unavailable\n", hash);
+        return 1;
+    }
+
+    if (trials > 0) {
+        int ok = run_trials(trials, jobs, threads, mode, format);
+        free_digest();
+        free_backend();
+        EVP_MD_free(md);
+        return !ok;
+    }
+
+    long long weak = weak_trial(threads);
+    long long strong = strong_search(mode, threads);
+    free_table();
+
+    printf("weak %lld strong %lld\n", weak, strong);
 
-#endif 
+    free_digest();
+    free_backend();
+    EVP_MD_free(md);
+    return weak < 0 || strong < 0;
+}
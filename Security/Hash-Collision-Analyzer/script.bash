@@ -1,28 +1,6 @@
 #!/bin/bash
+#
+# Runs 100 trials inside one ./main and prints their statistics
+# Extra arguments go to ./main, e.g. bash script.bash --bits 20 --format csv
 
-total_weak=0
-total_strong=0
-trials=100
-
-echo "Trial #  Weak Attempts    Strong Attempts"
-echo "-----------------------------------------"
-
-for ((i = 1; i <= trials; i++)); do
-    output=$(./main)
-    
-    weak=$(echo "$output" | awk '{print $2}')
-    strong=$(echo "$output" | awk '{print $4}')
-
-    echo "$i           $weak           $strong"
-
-    total_weak=$((total_weak + weak))
-    total_strong=$((total_strong + strong))
-done
-
-avg_weak=$(echo "scale=2; $total_weak / $trials" | bc)
-avg_strong=$(echo "scale=2; $total_strong / $trials" | bc)
-
-echo
-echo "================== Averages =================="
-echo "Average Weak Attempts:   $avg_weak"
-echo "Average Strong Attempts: $avg_strong"
\ No newline at end of file
+exec ./main --trials 100 "$@"
@@ -0,0 +1,332 @@
+#include "configs.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_X86 1
+#endif
+
+// Every candidate is at most MAX_BUFF bytes, so its padded message is one block
+#if MAX_BUFF > 55 || CAND_STRIDE < (MAX_BUFF + 3) / 4 * 4
+#error "MAX_BUFF must fit one SHA-256 block"
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t H0[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+// Selected kernels, set once by select_kernel before any thread starts
+static const struct Sha256Kernel* batch_kernel = NULL;
+static const struct Sha256Kernel* single_kernel = NULL;
+
+// Padded block for cand_len characters, also set by select_kernel
+// Word i is (candidate word & keep_mask[i]) | pad_block[i], and only the
+// first var_words words depend on the candidate
+static uint32_t pad_block[16];
+static uint32_t keep_mask[16];
+static int var_words;
+static int trunc_shift;
+
+
+/******************************************************************************
+ * Name: set_padding
+ * Description:
+ *     Builds the padded block template for the current candidate length
+ * Parameters:
+ *     - None
+******************************************************************************/
+static void set_padding() {
+    int i;
+
+    memset(pad_block, 0, sizeof(pad_block));
+    memset(keep_mask, 0, sizeof(keep_mask));
+    var_words = (cand_len + 3) / 4;
+    for (i = 0; i < var_words; i++) {
+        int bytes = cand_len - i * 4 < 4 ? cand_len - i * 4 : 4;
+        keep_mask[i] = (uint32_t)(0xFFFFFFFF00000000ULL >> (bytes * 8));
+    }
+    pad_block[cand_len / 4] = 0x80000000u >> (cand_len % 4 * 8);
+    pad_block[15] = cand_len * 8;
+    trunc_shift = 64 - hash_bits;
+}
+
+
+/******************************************************************************
+ * Name: pad_word
+ * Description:
+ *     Word i of the padded block of a candidate, big endian
+ * Parameters:
+ *     - str: Candidate, CAND_STRIDE bytes readable
+ *     - i: Word index
+******************************************************************************/
+static inline uint32_t pad_word(const char* str, int i) {
+    uint32_t word = 0;
+    if (i < var_words) {
+        memcpy(&word, str + i * 4, 4);
+        word = __builtin_bswap32(word) & keep_mask[i];
+    }
+    return word | pad_block[i];
+}
+
+
+/******************************************************************************
+ * Name: hash_openssl
+ * Description:
+ *     One candidate through digest_data, the reference kernel
+ * Parameters:
+ *     - in: Candidate string
+ *     - out: The output hash
+******************************************************************************/
+static int hash_openssl(const char* in, uint64_t* out) {
+    return digest_data(in, out);
+}
+
+
+#ifdef HAVE_X86
+
+// Multi-buffer kernel, one candidate per vector lane
+// Block words past var_words are the same broadcast constant in every lane
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define DEFINE_LANES_KERNEL(name, isa, lanes)                                   \
+typedef uint32_t name##_vec __attribute__((vector_size((lanes) * 4)));            \
+__attribute__((target(isa)))                                                   \
+static int name(const char* in, uint64_t* out) {                                  \
+    name##_vec w[16], s[8], t1, t2;                                               \
+    int i, l;                                                                     \
+                                                                                  \
+    for (i = 0; i < 16; i++) {                                                    \
+        if (i < var_words) {                                                      \
+            for (l = 0; l < (lanes); l++) {                                       \
+                w[i][l] = pad_word(in + l * CAND_STRIDE, i);                      \
+            }                                                                     \
+        } else {                                                                  \
+            w[i] = (name##_vec){0} + pad_block[i];                                \
+        }                                                                         \
+    }                                                                             \
+    for (i = 0; i < 8; i++) {                                                     \
+        s[i] = (name##_vec){0} + H0[i];                                           \
+    }                                                                             \
+    _Pragma("GCC unroll 64")                                                      \
+    for (i = 0; i < 64; i++) {                                                    \
+        name##_vec kw;                                                            \
+        if (i >= 16) {                                                            \
+            name##_vec a = w[(i - 15) & 15], b = w[(i - 2) & 15];                 \
+            w[i & 15] += (ROTR(a, 7) ^ ROTR(a, 18) ^ (a >> 3)) + w[(i - 7) & 15] \
+                + (ROTR(b, 17) ^ ROTR(b, 19) ^ (b >> 10));                        \
+            kw = w[i & 15] + K[i];                                                \
+        } else {                                                                  \
+            kw = w[i] + K[i];                                                     \
+        }                                                                         \
+        t1 = s[7] + (ROTR(s[4], 6) ^ ROTR(s[4], 11) ^ ROTR(s[4], 25))             \
+            + ((s[4] & s[5]) ^ (~s[4] & s[6])) + kw;                              \
+        t2 = (ROTR(s[0], 2) ^ ROTR(s[0], 13) ^ ROTR(s[0], 22))                    \
+            + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));                    \
+        s[7] = s[6]; s[6] = s[5]; s[5] = s[4]; s[4] = s[3] + t1;                  \
+        s[3] = s[2]; s[2] = s[1]; s[1] = s[0]; s[0] = t1 + t2;                    \
+    }                                                                             \
+    s[0] += H0[0];                                                                \
+    s[1] += H0[1];                                                                \
+    for (l = 0; l < (lanes); l++) {                                               \
+        out[l] = ((uint64_t)s[0][l] << 32 | s[1][l]) >> trunc_shift;              \
+    }                                                                             \
+    return 1;                                                                     \
+}
+
+DEFINE_LANES_KERNEL(hash_avx2, "avx2", 8)
+DEFINE_LANES_KERNEL(hash_avx512, "avx512f", 16)
+
+
+/******************************************************************************
+ * Name: hash_shani
+ * Description:
+ *     One candidate with the SHA extensions, two rounds per instruction
+ * Parameters:
+ *     - in: Candidate string
+ *     - out: The output hash
+******************************************************************************/
+__attribute__((target("sha,sse4.1")))
+static int hash_shani(const char* in, uint64_t* out) {
+    uint32_t block[16], state[8];
+    __m128i m[4], msg, tmp, state0, state1, abef, cdgh;
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        block[i] = pad_word(in, i);
+    }
+    for (i = 0; i < 4; i++) {
+        m[i] = _mm_loadu_si128((const __m128i*)&block[i * 4]);
+    }
+
+    // Rounds work on ABEF and CDGH halves of the state
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&H0[0]), 0xB1);
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&H0[4]), 0x1B);
+    state0 = abef = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = cdgh = _mm_blend_epi16(state1, tmp, 0xF0);
+
+#pragma GCC unroll 16
+    for (i = 0; i < 16; i++) {
+        if (i >= 4) {
+            m[i & 3] = _mm_sha256msg2_epu32(
+                _mm_add_epi32(_mm_sha256msg1_epu32(m[i & 3], m[(i + 1) & 3]),
+                              _mm_alignr_epi8(m[(i + 3) & 3], m[(i + 2) & 3], 4)),
+                m[(i + 3) & 3]);
+        }
+        msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i*)&K[i * 4]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+
+    // Back to ABCD EFGH order
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+
+    *out = ((uint64_t)state[0] << 32 | state[1]) >> trunc_shift;
+    return 1;
+}
+
+
+static int has_avx2() { return __builtin_cpu_supports("avx2"); }
+static int has_avx512() { return __builtin_cpu_supports("avx512f"); }
+
+static int has_shani() {
+    unsigned int a, b, c, d;
+    return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29)) && __builtin_cpu_supports("sse4.1");
+}
+
+#endif
+
+
+static int has_openssl() { return 1; }
+
+// Every kernel, best first. auto takes the first that is supported and
+// matches the reference
+static const struct Sha256Kernel kernels[] = {
+#ifdef HAVE_X86
+    {"avx512", 16, has_avx512, hash_avx512},
+    {"avx2", 8, has_avx2, hash_avx2},
+    {"shani", 1, has_shani, hash_shani},
+#endif
+    {"openssl", 1, has_openssl, hash_openssl},
+};
+#define KERNEL_COUNT ((int)(sizeof(kernels) / sizeof(kernels[0])))
+
+
+/******************************************************************************
+ * Name: check_kernel
+ * Description:
+ *     Compares a kernel with digest_data on a few batches of candidates
+ * Parameters:
+ *     - k: Kernel to check
+******************************************************************************/
+static int check_kernel(const struct Sha256Kernel* k) {
+    char strs[16][CAND_STRIDE];
+    uint64_t got[16], want;
+    int round, l;
+
+    if (!k->supported()) {
+        return 0;
+    }
+    for (round = 0; round < 4; round++) {
+        for (l = 0; l < k->lanes; l++) {
+            generate_string(strs[l], cand_len);
+        }
+        if (!k->hash(strs[0], got)) {
+            return 0;
+        }
+        for (l = 0; l < k->lanes; l++) {
+            if (!digest_data(strs[l], &want) || want != got[l]) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/******************************************************************************
+ * Name: select_kernel
+ * Description:
+ *     Picks the SHA-256 kernel used by sha256_batch, for the current
+ *     cand_len and hash_bits. Returns 0 if it is unknown, unsupported or disagrees with OpenSSL
+ * Parameters:
+ *     - name: Kernel name, or "auto" for the fastest working one
+******************************************************************************/
+int select_kernel(const char* name) {
+    int i, any = strcmp(name, "auto") == 0;
+
+    set_padding();
+    batch_kernel = single_kernel = NULL;
+    for (i = 0; i < KERNEL_COUNT; i++) {
+        const struct Sha256Kernel* k = &kernels[i];
+        if ((any || strcmp(name, k->name) == 0) && check_kernel(k)) {
+            if (batch_kernel == NULL) {
+                batch_kernel = k;
+            }
+            if (single_kernel == NULL && k->lanes == 1) {
+                single_kernel = k;
+            }
+        }
+    }
+
+    // A forced wide kernel still hashes odd candidates with the reference
+    if (single_kernel == NULL) {
+        single_kernel = &kernels[KERNEL_COUNT - 1];
+    }
+    return batch_kernel != NULL;
+}
+
+
+/******************************************************************************
+ * Name: kernel_name
+ * Description:
+ *     Name of the selected batch kernel
+ * Parameters:
+ *     - None
+******************************************************************************/
+const char* kernel_name() {
+    return batch_kernel != NULL ? batch_kernel->name : "none";
+}
+
+
+/******************************************************************************
+ * Name: sha256_batch
+ * Description:
+ *     Hashes count candidates with the selected kernel, truncated like
+ *     digest_data. Falls back to the one lane kernel for a short tail
+ * Parameters:
+ *     - strs: count strings of CAND_STRIDE characters, back to back
+ *     - count: Number of candidates
+ *     - hashes: count truncated hashes
+******************************************************************************/
+int sha256_batch(const char* strs, int count, uint64_t* hashes) {
+    const struct Sha256Kernel* k = batch_kernel != NULL ? batch_kernel : &kernels[KERNEL_COUNT - 1];
+    int i = 0;
+
+    for (; i + k->lanes <= count; i += k->lanes) {
+        if (!k->hash(strs + i * CAND_STRIDE, hashes + i)) {
+            return 0;
+        }
+    }
+    k = single_kernel != NULL ? single_kernel : &kernels[KERNEL_COUNT - 1];
+    for (; i < count; i++) {
+        if (!k->hash(strs + i * CAND_STRIDE, hashes + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}